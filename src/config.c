@@ -21,6 +21,7 @@
 
 #include "ff_gen_drv.h"
 
+#include "record.h"
 #include "config.h"
 
 #define CONFIG_FILE_NAME				"config"
@@ -31,10 +32,50 @@
 static uint8_t config_buf[CONFIG_FILE_SIZE];
 
 
-void config_save(config_t *cfg)
+static int8_t write_file(void)
 {
 	FIL f;
 	UINT num;
+
+	if (f_open(&f, CONFIG_FILE_NAME, FA_CREATE_ALWAYS | FA_WRITE)) {
+		/* Error */
+		return -1;
+	}
+
+        if (f_write(&f, config_buf, sizeof(config_buf), &num) || (num < sizeof(config_buf))) {
+		/* Error */
+		f_close(&f);
+		return -1;
+	}
+
+	f_close(&f);
+
+	return 0;
+}
+
+static int8_t read_file(void)
+{
+	FIL f;
+	UINT num;
+
+	if (f_open(&f, CONFIG_FILE_NAME, FA_OPEN_EXISTING | FA_READ)) {
+		/* Error */
+		return -1;
+	}
+
+	if (f_read(&f, config_buf, sizeof(config_buf), &num) || (num < sizeof(config_buf))) {
+		/* Error */
+		f_close(&f);
+		return -1;
+	}
+
+	f_close(&f);
+
+	return 0;
+}
+
+void config_save(config_t *cfg)
+{
 	uint8_t *ptr = config_buf;
 
 	/* First the magic, then the version, and finally the fields of
@@ -70,39 +111,21 @@ void config_save(config_t *cfg)
 	ptr[0] = cfg->autosave_enabled & 0x1;
 	ptr += 1;
 
-	if (f_open(&f, CONFIG_FILE_NAME, FA_CREATE_ALWAYS | FA_WRITE)) {
-		/* Error */
-		return;
-	}
-
-        if (f_write(&f, config_buf, sizeof(config_buf), &num) || (num < sizeof(config_buf))) {
-		/* Error */
-		f_close(&f);
-		return;
+	/* The file is only written if there is no data EEPROM, or by config_mirror() */
+	if (record_write(RECORD_CONFIG, config_buf, sizeof(config_buf)) < 0) {
+		write_file();
 	}
-
-	f_close(&f);
 }
 
 int8_t config_load(config_t *cfg)
 {
-	FIL f;
-	UINT num;
 	uint8_t *ptr = config_buf;
 
-	if (f_open(&f, CONFIG_FILE_NAME, FA_OPEN_EXISTING | FA_READ)) {
-		/* Error */
+	/* The EEPROM record is more recent than the file, if any */
+	if (record_read(RECORD_CONFIG, config_buf, sizeof(config_buf)) < 0 && read_file() < 0) {
 		return -1;
 	}
 
-	if (f_read(&f, config_buf, sizeof(config_buf), &num) || (num < sizeof(config_buf))) {
-		/* Error */
-		f_close(&f);
-		return -1;
-	}
-
-	f_close(&f);
-
 	/* First the magic, then the version, and finally the fields of
 	 * the config_t struct written as u8 following the struct order
 	 */
@@ -141,3 +164,16 @@ int8_t config_load(config_t *cfg)
 
 	return 0;
 }
+
+void config_mirror(void)
+{
+	if (record_read(RECORD_CONFIG, config_buf, sizeof(config_buf)) < 0) {
+		/* Nothing to do */
+		return;
+	}
+
+	/* Once written, the file becomes the reference, so that it can be edited over USB */
+	if (write_file() == 0) {
+		record_invalidate(RECORD_CONFIG);
+	}
+}
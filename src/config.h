@@ -36,4 +36,7 @@ typedef struct {
 void config_save(config_t *cfg);
 int8_t config_load(config_t *cfg);
 
+/* Copies the configuration kept in the data EEPROM to the file system */
+void config_mirror(void);
+
 #endif /* _CONFIG_H_ */
@@ -0,0 +1,185 @@
+/*
+ * MCUGotchi - A Tamagotchi P1 emulator for microcontrollers
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+#include "link.h"
+
+#define LINK_VERSION					1
+
+#define REQUEST_HEADER_SIZE				4
+#define RESPONSE_HEADER_SIZE				3
+
+/* Holds the request, then the response. Word aligned so that the payload can be
+ * given as is to the storage.
+ */
+static uint32_t buf_words[(REQUEST_HEADER_SIZE + LINK_MAX_PAYLOAD_SIZE + sizeof(uint32_t) - 1)/sizeof(uint32_t)];
+static uint8_t *buf = (uint8_t *) buf_words;
+static uint16_t buf_len = 0;
+
+/* Bytes of a request too long still to be received, they are dropped */
+static uint16_t discard_len = 0;
+
+static const link_ops_t *link_ops = NULL;
+static link_write_t link_write = NULL;
+
+
+void link_init(const link_ops_t *ops)
+{
+	link_ops = ops;
+	link_reset();
+}
+
+void link_set_transport(link_write_t write)
+{
+	link_write = write;
+	link_reset();
+}
+
+void link_reset(void)
+{
+	buf_len = 0;
+	discard_len = 0;
+}
+
+static uint16_t get_payload_length(void)
+{
+	return buf[2] | (buf[3] << 8);
+}
+
+static void discard(uint8_t **data, uint16_t *length)
+{
+	uint16_t len = (*length < discard_len) ? *length : discard_len;
+
+	*data += len;
+	*length -= len;
+	discard_len -= len;
+}
+
+int8_t link_receive(uint8_t *data, uint16_t length)
+{
+	uint16_t request_len;
+
+	/* Whatever is left of a request too long is not a new request */
+	discard(&data, &length);
+
+	if (buf_len < REQUEST_HEADER_SIZE) {
+		while (length > 0 && buf_len < REQUEST_HEADER_SIZE) {
+			buf[buf_len++] = *(data++);
+			length--;
+		}
+
+		if (buf_len < REQUEST_HEADER_SIZE) {
+			return 0;
+		}
+
+		/* A request too long is answered as soon as its header is received, and its payload dropped */
+		if (get_payload_length() > LINK_MAX_PAYLOAD_SIZE) {
+			discard_len = get_payload_length();
+			discard(&data, &length);
+		}
+	}
+
+	if (get_payload_length() > LINK_MAX_PAYLOAD_SIZE) {
+		return 1;
+	}
+
+	request_len = REQUEST_HEADER_SIZE + get_payload_length();
+
+	while (length > 0 && buf_len < request_len) {
+		buf[buf_len++] = *(data++);
+		length--;
+	}
+
+	return (buf_len >= request_len);
+}
+
+static int16_t execute(uint8_t cmd, uint8_t *payload, uint16_t length, uint8_t *out, uint16_t size)
+{
+	if (link_ops == NULL) {
+		return -1;
+	}
+
+	switch (cmd) {
+		case LINK_CMD_PING:
+			out[0] = LINK_VERSION;
+			return 1;
+
+		case LINK_CMD_GET_STATE:
+			return link_ops->get_state(out, size);
+
+		case LINK_CMD_SET_STATE:
+			return link_ops->set_state(payload, length);
+
+		case LINK_CMD_ROM_BEGIN:
+			return link_ops->rom_begin();
+
+		case LINK_CMD_ROM_DATA:
+			return link_ops->rom_data(payload, length);
+
+		case LINK_CMD_ROM_END:
+			return link_ops->rom_end();
+
+		case LINK_CMD_GET_FRAME:
+			return link_ops->get_frame(out, size);
+
+		default:
+			return -1;
+	}
+}
+
+void link_process(void)
+{
+	uint8_t cmd = buf[0];
+	uint16_t length = get_payload_length();
+	int16_t ret;
+
+	if (buf_len < REQUEST_HEADER_SIZE) {
+		/* Nothing to do */
+		return;
+	}
+
+	/* The response overwrites the request, the request payload must have been used before
+	 * any response payload is written
+	 */
+	if (length > LINK_MAX_PAYLOAD_SIZE) {
+		buf[0] = LINK_STATUS_TOO_LONG;
+		ret = 0;
+	} else if (cmd > LINK_CMD_GET_FRAME) {
+		buf[0] = LINK_STATUS_UNKNOWN_CMD;
+		ret = 0;
+	} else {
+		ret = execute(cmd, &buf[REQUEST_HEADER_SIZE], length, &buf[RESPONSE_HEADER_SIZE], LINK_MAX_PAYLOAD_SIZE);
+		buf[0] = (ret < 0) ? LINK_STATUS_ERROR : LINK_STATUS_OK;
+
+		if (ret < 0) {
+			ret = 0;
+		}
+	}
+
+	buf[1] = ret & 0xFF;
+	buf[2] = (ret >> 8) & 0xFF;
+
+	buf_len = 0;
+
+	if (link_write != NULL) {
+		link_write(buf, RESPONSE_HEADER_SIZE + ret);
+	}
+}
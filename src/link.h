@@ -0,0 +1,79 @@
+/*
+ * MCUGotchi - A Tamagotchi P1 emulator for microcontrollers
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef _LINK_H_
+#define _LINK_H_
+
+#include <stdint.h>
+
+/* Simple command protocol, independent of the transport carrying it.
+ *
+ * Request:  command (u8), argument (u8), payload length (u16 little-endian), payload
+ * Response: status (u8), payload length (u16 little-endian), payload
+ */
+#define LINK_MAX_PAYLOAD_SIZE				832 // in bytes, a state fits in a single request
+
+typedef enum {
+	LINK_CMD_PING = 0, // Returns the protocol version (u8)
+	LINK_CMD_GET_STATE, // Returns the state of the running emulation
+	LINK_CMD_SET_STATE, // Replaces the state of the running emulation
+	LINK_CMD_ROM_BEGIN, // Starts programming a ROM to the ROM storage area
+	LINK_CMD_ROM_DATA, // Big-endian ROM dump data, following the previous one, multiple of 4 bytes
+	LINK_CMD_ROM_END, // Checks the programmed ROM and runs it
+	LINK_CMD_GET_FRAME, // Returns the LCD dot matrix (one bit per pixel, row by row) followed by the icons (u8)
+} link_cmd_t;
+
+typedef enum {
+	LINK_STATUS_OK = 0,
+	LINK_STATUS_ERROR,
+	LINK_STATUS_UNKNOWN_CMD,
+	LINK_STATUS_TOO_LONG,
+} link_status_t;
+
+/* Operations backing the commands. They return a negative value on error, otherwise
+ * the length of the data written to buf if any.
+ */
+typedef struct {
+	int16_t (*get_state)(uint8_t *buf, uint16_t size);
+	int16_t (*set_state)(uint8_t *buf, uint16_t length);
+	int16_t (*rom_begin)(void);
+	int16_t (*rom_data)(uint8_t *buf, uint16_t length);
+	int16_t (*rom_end)(void);
+	int16_t (*get_frame)(uint8_t *buf, uint16_t size);
+} link_ops_t;
+
+/* Sends a whole response, the data must remain valid until the next request is received */
+typedef void (*link_write_t)(uint8_t *data, uint16_t length);
+
+
+void link_init(const link_ops_t *ops);
+void link_set_transport(link_write_t write);
+
+/* Drops any partially received request */
+void link_reset(void);
+
+/* Feeds received data, returns 1 once a whole request is available. The next one
+ * must not be fed before link_process() is called.
+ */
+int8_t link_receive(uint8_t *data, uint16_t length);
+
+/* Executes the received request and sends the response */
+void link_process(void);
+
+#endif /* _LINK_H_ */
@@ -24,6 +24,7 @@
 #include "job.h"
 #include "time.h"
 #include "storage.h"
+#include "eeprom.h"
 #include "state.h"
 #include "input.h"
 #include "led.h"
@@ -32,8 +33,10 @@
 #include "battery.h"
 #include "usb.h"
 #include "fs_ll.h"
+#include "link.h"
 #include "rom.h"
 #include "config.h"
+#include "profiler.h"
 #include "board.h"
 #if defined(BOARD_HAS_SSD1306)
 #include "ssd1306.h"
@@ -66,10 +69,6 @@
 #define PLEASE_WAIT_Y					24
 #define PLEASE_WAIT_STR					"Please Wait"
 
-#define AUTOSAVING_X					14
-#define AUTOSAVING_Y					24
-#define AUTOSAVING_STR					"Autosaving"
-
 #define BATTERY_ON_X					114
 #define BATTERY_ON_Y					21
 #define BATTERY_OFF_X					58
@@ -81,8 +80,10 @@
 #define FRAMERATE 					30
 
 #define TAMALIB_FREQ					32768 // Hz
+#define TAMALIB_STEPS_PER_CHECK				32
 
 #define MAIN_JOB_PERIOD					10 //ms
+#define SCREEN_OFF_JOB_PERIOD				1000 //ms
 #define BATTERY_JOB_PERIOD				60000 //ms
 #define BACKLIGHT_OFF_PERIOD				5000 //ms
 #define AUTOSAVE_PERIOD					3600000 //ms
@@ -93,9 +94,17 @@
 #define BATTERY_LOW					3650 // mV
 #define BATTERY_MAX_LEVEL				5
 
-#define AUTOSAVE_SLOT					0
+#define AUTOSAVE_SLOT					STATE_AUTOSAVE_SLOT
 
-static volatile u12_t *g_program = (volatile u12_t *) (STORAGE_BASE_ADDRESS + (STORAGE_ROM_OFFSET << 2));
+typedef enum {
+	BOOT_STORAGE = 0,
+	BOOT_CONFIG,
+	BOOT_ROM,
+	BOOT_STATE,
+	BOOT_DISPLAY,
+	BOOT_FRAME,
+	BOOT_PHASES_NUM,
+} boot_phase_t;
 
 static bool_t matrix_buffer[LCD_HEIGHT][LCD_WIDTH] = {{0}};
 static bool_t icon_buffer[ICON_NUM] = {0};
@@ -103,12 +112,14 @@ static bool_t icon_buffer[ICON_NUM] = {0};
 static uint16_t time_shift = 0;
 
 static bool_t tamalib_is_late = 0;
+static timestamp_t tamalib_now = 0;
 
 static job_t cpu_job;
 static job_t render_job;
 static job_t battery_job;
 static job_t backlight_job;
 static job_t autosave_job;
+static job_t autosave_step_job;
 static job_t autooff_job;
 
 static uint8_t speed_ratio = 1;
@@ -116,12 +127,17 @@ static bool_t emulation_paused = 0;
 static bool_t usb_enabled = 0;
 static bool_t rom_loaded = 1;
 static bool_t power_off_mode = 0;
+static bool_t screen_off_mode = 0;
 static bool_t is_backlight_on = 0;
 static bool_t is_charging = 0;
 static bool_t is_calling = 0;
 static bool_t is_vbus = 0;
 static uint16_t current_battery = BATTERY_MAX;
 
+/* End of each boot phase in ms, 0 if it has not been reached */
+static uint32_t boot_times[BOOT_PHASES_NUM] = {0};
+static mcu_time_t io_ready_time;
+
 /* Default config values */
 static config_t config = {
 	.lcd_inverted = 0,
@@ -218,8 +234,17 @@ static const bool_t icons[ICON_NUM][ICON_SIZE][ICON_SIZE] = {
 
 static void battery_job_fn(job_t *job);
 static void autosave_job_fn(job_t *job);
+static void autosave_step_job_fn(job_t *job);
 static void autooff_job_fn(job_t *job);
+static void render_job_fn(job_t *job);
+static void cpu_job_fn(job_t *job);
+static void screen_on(void);
+
 
+static void end_boot_phase(boot_phase_t phase)
+{
+	boot_times[phase] = ((uint64_t) time_get() * 1000000ULL)/MCU_TIME_FREQ_X1000;
+}
 
 static void update_led(void)
 {
@@ -282,10 +307,16 @@ static timestamp_t hal_get_timestamp(void)
 static void hal_sleep_until(timestamp_t ts)
 {
 	/* Since TamaLIB is always late in implementations without mainloop,
-	 * notify the cpu job that TamaLIB catched up instead of waiting
+	 * notify the cpu job that TamaLIB catched up instead of waiting.
+	 * The timestamp is only read again once TamaLIB reaches the last known one,
+	 * which saves a timer access per executed instruction while catching up.
 	 */
-	if ((int32_t) (ts - hal_get_timestamp()) > 0) {
-		tamalib_is_late = 0;
+	if ((int32_t) (ts - tamalib_now) > 0) {
+		tamalib_now = hal_get_timestamp();
+
+		if ((int32_t) (ts - tamalib_now) > 0) {
+			tamalib_is_late = 0;
+		}
 	}
 }
 
@@ -309,6 +340,11 @@ static void hal_set_lcd_icon(u8_t icon, bool_t val)
 		is_calling = val;
 
 		update_led();
+
+		if (val && screen_off_mode) {
+			/* The Tamagotchi needs attention, wake the screen up */
+			screen_on();
+		}
 	}
 
 	icon_buffer[icon] = val;
@@ -321,7 +357,8 @@ static void hal_set_frequency(u32_t freq)
 
 static void hal_play_frequency(bool_t en)
 {
-	speaker_enable((uint8_t) (en && config.speaker_enabled));
+	/* Emulation runs in bursts while the screen is OFF, thus sounds would be garbled */
+	speaker_enable((uint8_t) (en && config.speaker_enabled && !screen_off_mode));
 }
 
 static int hal_handler(void)
@@ -426,15 +463,6 @@ static void please_wait_screen(void)
 	gfx_print_screen();
 }
 
-static void autosaving_screen(void)
-{
-	gfx_clear();
-
-	gfx_string(AUTOSAVING_STR, AUTOSAVING_X, AUTOSAVING_Y, 1, COLOR_ON_BLACK, BACKGROUND_ON);
-
-	gfx_print_screen();
-}
-
 static void no_rom_screen(void)
 {
 	gfx_string("No ROM found !", 0, 0, 0, COLOR_ON_BLACK, BACKGROUND_ON);
@@ -477,6 +505,118 @@ static void user_feedback(void)
 	turn_on_backlight(0);
 }
 
+static void start_program(void)
+{
+	if (tamalib_init(rom_get_program(), NULL, (MCU_TIME_FREQ_X1000 << time_shift)/1000)) {
+		system_fatal_error();
+	}
+
+	tamalib_set_speed(speed_ratio);
+	profiler_init(rom_get_program());
+}
+
+static void restart_program(void)
+{
+	/* The program might now be executed from another location */
+	tamalib_release();
+	start_program();
+}
+
+static int16_t link_get_state(uint8_t *buf, uint16_t size)
+{
+	if (!rom_loaded || size < STATE_SIZE) {
+		return -1;
+	}
+
+	state_snapshot(buf);
+
+	return STATE_SIZE;
+}
+
+static int16_t link_set_state(uint8_t *buf, uint16_t length)
+{
+	if (!rom_loaded || length != STATE_SIZE) {
+		return -1;
+	}
+
+	return state_restore(buf);
+}
+
+static int16_t link_rom_begin(void)
+{
+	/* The running program must not be overwritten while being executed */
+	if (rom_loaded && !rom_is_in_place()) {
+		emulation_paused = 1;
+		tamalib_set_exec_mode(emulation_paused ? EXEC_MODE_PAUSE : EXEC_MODE_RUN);
+	}
+
+	rom_stream_start();
+
+	return 0;
+}
+
+static int16_t link_rom_data(uint8_t *buf, uint16_t length)
+{
+	return rom_stream_write(buf, length);
+}
+
+static int16_t link_rom_end(void)
+{
+	if (rom_stream_end() < 0) {
+		return -1;
+	}
+
+	/* Without any ROM loaded, the new one is picked up by the reset performed when leaving USB mode */
+	if (rom_loaded) {
+		restart_program();
+
+		emulation_paused = 0;
+		tamalib_set_exec_mode(emulation_paused ? EXEC_MODE_PAUSE : EXEC_MODE_RUN);
+	}
+
+	return 0;
+}
+
+static int16_t link_get_frame(uint8_t *buf, uint16_t size)
+{
+	uint16_t len = (LCD_WIDTH * LCD_HEIGHT)/8;
+	uint8_t i, j;
+
+	if (size < len + 1) {
+		return -1;
+	}
+
+	for (i = 0; i < len + 1; i++) {
+		buf[i] = 0;
+	}
+
+	/* One bit per pixel, MSB first */
+	for (j = 0; j < LCD_HEIGHT; j++) {
+		for (i = 0; i < LCD_WIDTH; i++) {
+			if (matrix_buffer[j][i]) {
+				buf[(j * LCD_WIDTH + i)/8] |= 0x80 >> (i % 8);
+			}
+		}
+	}
+
+	for (i = 0; i < ICON_NUM; i++) {
+		if (icon_buffer[i]) {
+			buf[len] |= 1 << i;
+		}
+	}
+
+	return len + 1;
+}
+
+static const link_ops_t link_ops = {
+	.get_state = &link_get_state,
+	.set_state = &link_set_state,
+	.rom_begin = &link_rom_begin,
+	.rom_data = &link_rom_data,
+	.rom_end = &link_rom_end,
+	.get_frame = &link_get_frame,
+};
+
 static void enable_usb(void)
 {
 	/* Disable auto-power-off when USB is enabled */
@@ -484,8 +624,18 @@ static void enable_usb(void)
 		job_cancel(&autooff_job);
 	}
 
-	emulation_paused = 1;
-	tamalib_set_exec_mode(emulation_paused ? EXEC_MODE_PAUSE : EXEC_MODE_RUN);
+	/* The emulation keeps running, unless its program lies in the file system handed over to the host */
+	if (rom_loaded && rom_is_in_place()) {
+		emulation_paused = 1;
+		tamalib_set_exec_mode(emulation_paused ? EXEC_MODE_PAUSE : EXEC_MODE_RUN);
+	}
+
+	/* Make the records kept in the data EEPROM visible from the host */
+	config_mirror();
+	state_mirror();
+
+	/* Saves are kept in RAM until the host is done */
+	state_hold_files(1);
 
 	fs_ll_umount();
 
@@ -504,6 +654,30 @@ static void disable_usb(void)
 
 	fs_ll_mount();
 
+	/* Write the save kept in RAM meanwhile, if any */
+	state_hold_files(0);
+	job_schedule(&autosave_step_job, &autosave_step_job_fn, time_get());
+
+	/* The host might have changed or moved a ROM executed in place */
+	if (rom_loaded) {
+		switch (rom_refresh()) {
+			case 1:
+				restart_program();
+				break;
+
+			case -1:
+				/* Look for another ROM by resetting the device */
+				please_wait_screen();
+				config_save(&config);
+				while (state_save_step() > 0);
+				system_reset();
+				break;
+
+			default:
+				break;
+		}
+	}
+
 	emulation_paused = 0;
 	tamalib_set_exec_mode(emulation_paused ? EXEC_MODE_PAUSE : EXEC_MODE_RUN);
 
@@ -513,6 +687,43 @@ static void disable_usb(void)
 	}
 }
 
+static void screen_off(void)
+{
+	/* Keep the emulation running in bursts, but turn OFF the display and the backlight */
+	screen_off_mode = 1;
+
+	speaker_enable(0);
+
+	backlight_set(0);
+	is_backlight_on = 0;
+	job_cancel(&backlight_job);
+
+	job_cancel(&render_job);
+
+#if defined(BOARD_HAS_SSD1306)
+	ssd1306_set_power_mode(PWR_MODE_SLEEP);
+#elif defined(BOARD_HAS_UC1701X)
+	uc1701x_set_power_mode(PWR_MODE_SLEEP);
+#endif
+}
+
+static void screen_on(void)
+{
+	screen_off_mode = 0;
+
+#if defined(BOARD_HAS_SSD1306)
+	ssd1306_set_power_mode(PWR_MODE_ON);
+#elif defined(BOARD_HAS_UC1701X)
+	uc1701x_set_power_mode(PWR_MODE_ON);
+#endif
+
+	turn_on_backlight(1);
+
+	/* Go back to the regular emulation pace */
+	job_schedule(&cpu_job, &cpu_job_fn, JOB_ASAP);
+	job_schedule(&render_job, &render_job_fn, JOB_ASAP);
+}
+
 static void power_on(void)
 {
 	power_off_mode = 0;
@@ -538,8 +749,15 @@ static void power_off(void)
 {
 	/* Disable everything so that the device goes to Stop mode */
 	if (!power_off_mode) {
+		screen_off_mode = 0;
+
 		please_wait_screen();
 
+		/* The file system must be available to save anything */
+		if (usb_enabled) {
+			disable_usb();
+		}
+
 		/* Save the current configuration */
 		config_save(&config);
 
@@ -554,10 +772,6 @@ static void power_off(void)
 
 		fs_ll_umount();
 
-		if (usb_enabled) {
-			disable_usb();
-		}
-
 		config.speaker_enabled = 0;
 
 		config.led_enabled = 0;
@@ -752,24 +966,89 @@ static char * menu_vbat_arg(uint8_t pos, menu_parent_t *parent)
 	return str;
 }
 
+static char * menu_time_arg(uint32_t t)
+{
+	static char str[] = "00000 ms";
+	int8_t i;
+
+	for (i = 4; i >= 0; i--) {
+		str[i] = '0' + t % 10;
+		t /= 10;
+	}
+
+	return str;
+}
+
+static char * menu_rom_time_arg(uint8_t pos, menu_parent_t *parent)
+{
+	/* Duration of the last ROM load */
+	return menu_time_arg(rom_get_load_time());
+}
+
+static char * menu_save_time_arg(uint8_t pos, menu_parent_t *parent)
+{
+	/* Duration of the last state save */
+	return menu_time_arg(state_get_save_time());
+}
+
+static char * menu_boot_time_arg(uint8_t pos, menu_parent_t *parent)
+{
+	/* The items follow the boot phases order */
+	return menu_time_arg(boot_times[pos]);
+}
+
+#ifdef FTL_ENABLED
+static char * menu_wear_arg(uint8_t pos, menu_parent_t *parent)
+{
+	static char str[] = "000000";
+	uint32_t count = ftl_get_max_erase_count();
+	int8_t i;
+
+	/* Erase count of the most worn block of the FAT volume */
+	for (i = sizeof(str) - 2; i >= 0; i--) {
+		str[i] = '0' + count % 10;
+		count /= 10;
+	}
+
+	return str;
+}
+#endif
+
 static void menu_power_off(uint8_t pos, menu_parent_t *parent)
 {
 	power_off();
 	menu_close();
 }
 
+static void menu_screen_off(uint8_t pos, menu_parent_t *parent)
+{
+	menu_close();
+	screen_off();
+}
+
 static void menu_reset_cpu(uint8_t pos, menu_parent_t *parent)
 {
 	cpu_reset();
 	menu_close();
 }
 
+#ifdef PROFILER_ENABLED
+static void menu_dump_profile(uint8_t pos, menu_parent_t *parent)
+{
+	please_wait_screen();
+
+	profiler_dump();
+	menu_close();
+}
+#endif
+
 static void menu_factory_reset(uint8_t pos, menu_parent_t *parent)
 {
 	please_wait_screen();
 
 	fs_ll_umount();
 	storage_erase();
+	eeprom_erase();
 	system_reset();
 }
 
@@ -856,20 +1135,32 @@ static void menu_roms(uint8_t pos, menu_parent_t *parent)
 		return;
 	}
 
-	cpu_reset();
+	restart_program();
 	menu_close();
 }
 
 static char * menu_roms_arg(uint8_t pos, menu_parent_t *parent)
 {
-	switch (rom_stat(pos)) {
-		default:
-		case 0:
-			return " ";
+	static char str[] = "*0000";
+	static const char hex[] = "0123456789ABCDEF";
+	uint32_t hash;
+	int8_t i;
 
-		case 1:
-			return "*";
+	if (!rom_stat(pos)) {
+		return " ";
+	}
+
+	if (rom_get_hash(pos, &hash) < 0) {
+		return "*";
+	}
+
+	/* Resident ROMs are told apart by the end of their hash */
+	for (i = 4; i >= 1; i--) {
+		str[i] = hex[hash & 0xF];
+		hash >>= 4;
 	}
+
+	return str;
 }
 
 static void menu_usb(uint8_t pos, menu_parent_t *parent)
@@ -905,15 +1196,36 @@ static menu_item_t emulation_menu[] = {
 	{"Speed  ", &menu_toggle_speed_arg, &menu_toggle_speed, 0, NULL},
 	{"", &menu_pause_arg, &menu_pause, 0, NULL},
 	{"Reset CPU", NULL, &menu_reset_cpu, 1, NULL},
+#ifdef PROFILER_ENABLED
+	{"Dump Profile", NULL, &menu_dump_profile, 0, NULL},
+#endif
+
+	{NULL, NULL, NULL, 0, NULL},
+};
+
+static menu_item_t boot_menu[] = {
+	{"FS ", &menu_boot_time_arg, NULL, 0, NULL},
+	{"Conf. ", &menu_boot_time_arg, NULL, 0, NULL},
+	{"ROM ", &menu_boot_time_arg, NULL, 0, NULL},
+	{"State ", &menu_boot_time_arg, NULL, 0, NULL},
+	{"Disp. ", &menu_boot_time_arg, NULL, 0, NULL},
+	{"Frame ", &menu_boot_time_arg, NULL, 0, NULL},
 
 	{NULL, NULL, NULL, 0, NULL},
 };
 
 static menu_item_t system_menu[] = {
 	{"Batt. ", &menu_vbat_arg, NULL, 0, NULL},
+	{"ROM ", &menu_rom_time_arg, NULL, 0, NULL},
+	{"Save ", &menu_save_time_arg, NULL, 0, NULL},
+	{"Boot", NULL, NULL, 0, boot_menu},
+#ifdef FTL_ENABLED
+	{"Wear ", &menu_wear_arg, NULL, 0, NULL},
+#endif
 	{"FW. "FIRMWARE_VERSION, NULL, NULL, 0, NULL},
 	{"FW. Update", NULL, &menu_firmware_update, 1, NULL},
 	{"Power OFF", NULL, &menu_power_off, 1, NULL},
+	{"Screen OFF", NULL, &menu_screen_off, 0, NULL},
 	{"Reset", NULL, &menu_reset_device, 1, NULL},
 	{"Fact. Reset", NULL, &menu_factory_reset, 1, NULL},
 
@@ -981,22 +1293,34 @@ static void ll_init(void)
 
 	battery_init();
 
+	/* The display powers up while the boot goes on, see ll_finish_init() */
 #if defined(BOARD_HAS_SSD1306)
 	ssd1306_init();
-	ssd1306_set_power_mode(PWR_MODE_ON);
-	ssd1306_set_display_mode(DISP_MODE_NORMAL);
 
 	gfx_register_display(&ssd1306_send_data);
 #elif defined(BOARD_HAS_UC1701X)
 	uc1701x_init();
-	uc1701x_set_power_mode(PWR_MODE_ON);
-	uc1701x_set_display_mode(DISP_MODE_NORMAL);
 
 	gfx_register_display(&uc1701x_send_data);
 #endif
 
-	/* Wait a little bit to make sure all I/Os are stable */
-	time_delay(MS_TO_MCU_TIME(10));
+	/* Give a little bit of time to all I/Os to be stable */
+	io_ready_time = time_get() + MS_TO_MCU_TIME(10);
+}
+
+static void ll_finish_init(void)
+{
+#if defined(BOARD_HAS_SSD1306)
+	ssd1306_finish_init();
+	ssd1306_set_power_mode(PWR_MODE_ON);
+	ssd1306_set_display_mode(DISP_MODE_NORMAL);
+#elif defined(BOARD_HAS_UC1701X)
+	uc1701x_finish_init();
+	uc1701x_set_power_mode(PWR_MODE_ON);
+	uc1701x_set_display_mode(DISP_MODE_NORMAL);
+#endif
+
+	time_wait_until(io_ready_time);
 
 	input_init();
 
@@ -1008,18 +1332,23 @@ static void autooff_job_fn(job_t *job)
 	power_off();
 }
 
+static void autosave_step_job_fn(job_t *job)
+{
+	/* Scheduled at the current time, so that the late CPU job goes first */
+	if (state_save_step() > 0) {
+		job_schedule(&autosave_step_job, &autosave_step_job_fn, time_get());
+	}
+}
+
 static void autosave_job_fn(job_t *job)
 {
 	job_schedule(&autosave_job, &autosave_job_fn, time_get() + MS_TO_MCU_TIME(AUTOSAVE_PERIOD));
 
-	autosaving_screen();
-
-	/* Save to autosave slot */
-	state_save(AUTOSAVE_SLOT);
-
-	if (menu_is_visible()) {
-		menu_draw();
-	}
+	/* Snapshot the state to the autosave slot between two steps, and write it
+	 * piece by piece in the background
+	 */
+	state_save_start(AUTOSAVE_SLOT);
+	job_schedule(&autosave_step_job, &autosave_step_job_fn, time_get());
 }
 
 static void render_job_fn(job_t *job)
@@ -1050,27 +1379,86 @@ static void render_job_fn(job_t *job)
 	}
 
 	gfx_print_screen();
+
+	if (rom_loaded && !boot_times[BOOT_FRAME]) {
+		end_boot_phase(BOOT_FRAME);
+	}
+}
+
+static mcu_time_t get_next_timer_delay(void)
+{
+	state_t *state = tamalib_get_state();
+	int32_t ticks, prog_ticks;
+	mcu_time_t delay;
+
+	/* The clock timer generates an interrupt every emulated second */
+	ticks = (int32_t) (*(state->clk_timer_timestamp) + TAMALIB_FREQ - *(state->tick_counter));
+
+	/* The programmable timer generates one when its 256 Hz down-counter reaches 0 */
+	if (*(state->prog_timer_enabled)) {
+		prog_ticks = (int32_t) (*(state->prog_timer_timestamp) + (*(state->prog_timer_data) ? *(state->prog_timer_data) : 256) * (TAMALIB_FREQ/256) - *(state->tick_counter));
+		if (prog_ticks < ticks) {
+			ticks = prog_ticks;
+		}
+	}
+
+	if (ticks <= 0) {
+		return 0;
+	}
+
+	/* Rounded up, waking up before the deadline would only produce an empty burst */
+	delay = ((uint64_t) ticks * MCU_TIME_FREQ_X1000 + TAMALIB_FREQ * 1000ULL - 1)/(TAMALIB_FREQ * 1000ULL);
+
+	/* Emulated time runs speed_ratio times faster, there is no relation at all at max speed (0) */
+	if (speed_ratio > 0) {
+		delay = (delay + speed_ratio - 1)/speed_ratio;
+
+		if (delay > MS_TO_MCU_TIME(SCREEN_OFF_JOB_PERIOD)) {
+			delay = MS_TO_MCU_TIME(SCREEN_OFF_JOB_PERIOD);
+		}
+	}
+
+	return delay;
 }
 
 static void cpu_job_fn(job_t *job)
 {
 	job_t *next_job;
+	uint8_t i;
 
-	job_schedule(&cpu_job, &cpu_job_fn, time_get() + MS_TO_MCU_TIME(MAIN_JOB_PERIOD));
+	/* While the screen is OFF, the emulation is only executed in bursts, once the next
+	 * emulated timer interrupt is due, so that the device can sleep in between.
+	 * The period is only used if the emulation cannot catch up (max speed).
+	 */
+	job_schedule(&cpu_job, &cpu_job_fn, time_get() + MS_TO_MCU_TIME(screen_off_mode ? SCREEN_OFF_JOB_PERIOD : MAIN_JOB_PERIOD));
 
 	tamalib_is_late = 1;
+	tamalib_now = hal_get_timestamp();
 
 	/* Execute all the missed steps at once */
 	while (tamalib_is_late) {
-		tamalib_step();
+		/* Run a batch of steps before checking the other jobs' deadlines,
+		 * TamaLIB handles the emulated interrupts by itself within each step
+		 */
+		for (i = 0; i < TAMALIB_STEPS_PER_CHECK && tamalib_is_late; i++) {
+			profiler_count();
+			tamalib_step();
+		}
 
 		next_job = job_get_next();
 		if (next_job != NULL && next_job->time <= time_get()) {
 			/* No more time to execute instructions */
 			job_schedule(&cpu_job, &cpu_job_fn, next_job->time);
-			break;
+			return;
 		}
 	}
+
+	if (screen_off_mode && !tamalib_is_late) {
+		/* The emulated CPU cannot do anything before its next timer interrupt,
+		 * buttons waking it up turn the screen back ON
+		 */
+		job_schedule(&cpu_job, &cpu_job_fn, time_get() + get_next_timer_delay());
+	}
 }
 
 static void battery_job_fn(job_t *job)
@@ -1114,6 +1502,13 @@ static void power_off_handler(input_t btn, input_state_t state, uint8_t long_pre
 	}
 }
 
+static void screen_off_handler(input_t btn, input_state_t state, uint8_t long_press)
+{
+	if (state == INPUT_STATE_HIGH && !long_press) {
+		screen_on();
+	}
+}
+
 static void usb_mode_btn_handler(input_t btn, input_state_t state, uint8_t long_press)
 {
 	user_feedback();
@@ -1184,6 +1579,10 @@ static void battery_charging_handler(input_state_t state)
 
 static void vbus_sensing_handler(input_state_t state)
 {
+	if (screen_off_mode) {
+		screen_on();
+	}
+
 	user_feedback();
 
 	is_vbus = (state == INPUT_STATE_HIGH);
@@ -1219,6 +1618,8 @@ static void input_handler(input_t input, input_state_t state, uint8_t long_press
 		case INPUT_BTN_RIGHT:
 			if (power_off_mode) {
 				power_off_handler(input, state, long_press);
+			} else if (screen_off_mode) {
+				screen_off_handler(input, state, long_press);
 			} else if (usb_enabled) {
 				usb_mode_btn_handler(input, state, long_press);
 			} else if (menu_is_visible()) {
@@ -1262,24 +1663,24 @@ int main(void)
 	/* Make sure the RGB LED is off */
 	led_set(0, 0, 0);
 
-	/* Clear any remaining data in RAM */
-	gfx_clear();
-	gfx_print_screen();
-
-	please_wait_screen();
-
+	/* Everything up to the first frame is loaded while the display powers up,
+	 * it stays OFF meanwhile, even if the storage has to be formatted
+	 */
 	fs_ll_init();
 	fs_ll_mount();
+	end_boot_phase(BOOT_STORAGE);
 
 	tamalib_register_hal(&hal);
+	link_init(&link_ops);
 
 	/* Try to load the configuration */
 	if (config_load(&config) < 0) {
 		config_save(&config);
 	}
+	end_boot_phase(BOOT_CONFIG);
 
-	/* Try to load the default ROM from the filesystem if it is not loaded */
-	if (!rom_is_loaded() && rom_load(DEFAULT_ROM_SLOT) < 0) {
+	/* Try to load the ROM used before the reset, or the default one from the filesystem */
+	if (rom_init() < 0) {
 		job_schedule(&autooff_job, &autooff_job_fn, time_get() + MS_TO_MCU_TIME(AUTOOFF_PERIOD));
 
 		rom_loaded = 0;
@@ -1291,19 +1692,26 @@ int main(void)
 			time_shift++;
 		}
 
-		if (tamalib_init((const u12_t *) g_program, NULL, (MCU_TIME_FREQ_X1000 << time_shift)/1000)) {
-			system_fatal_error();
-		}
+		start_program();
+		end_boot_phase(BOOT_ROM);
 
 		if (config.autosave_enabled) {
 			/* Try to load the autosave slot and schedule the next autosave */
 			state_load(AUTOSAVE_SLOT);
 			job_schedule(&autosave_job, &autosave_job_fn, time_get() + MS_TO_MCU_TIME(AUTOSAVE_PERIOD));
 		}
+		end_boot_phase(BOOT_STATE);
 
 		job_schedule(&cpu_job, &cpu_job_fn, JOB_ASAP);
 	}
 
+	ll_finish_init();
+
+	/* Clear any remaining data in RAM */
+	gfx_clear();
+	gfx_print_screen();
+	end_boot_phase(BOOT_DISPLAY);
+
 	states_init();
 
 	input_register_handler(&input_handler);
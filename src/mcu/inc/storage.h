@@ -29,4 +29,25 @@ int8_t storage_read(uint32_t offset, uint32_t *data, uint32_t length);
 int8_t storage_write(uint32_t offset, uint32_t *data, uint32_t length);
 int8_t storage_erase(void);
 
+/* Same as storage_write(), but the last written pages (up to STORAGE_CACHE_PAGES) are
+ * kept in RAM until they are evicted, least recently written first, or storage_flush() is called
+ */
+int8_t storage_write_cached(uint32_t offset, uint32_t *data, uint32_t length);
+int8_t storage_flush(void);
+
+/* Returns 1 if a cached page holds changes within the given range, the flash is then outdated */
+uint8_t storage_is_dirty(uint32_t offset, uint32_t length);
+
+/* Programs erased words without erasing anything, fails if a word to change is not erased */
+int8_t storage_program(uint32_t offset, uint32_t *data, uint32_t length);
+
+/* Erases the pages within the given range, which must be page aligned */
+int8_t storage_erase_pages(uint32_t offset, uint32_t length);
+
+/* Returns the STORAGE_PAGE_SIZE words long buffer used internally by storage_write(),
+ * after writing back any cached page. Data can be staged there before being written,
+ * as long as the write starts at the same offset within the page.
+ */
+uint32_t * storage_get_page_buffer(void);
+
 #endif /* _STORAGE_H_ */
@@ -0,0 +1,40 @@
+/*
+ * MCUGotchi - A Tamagotchi P1 emulator for microcontrollers
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdint.h>
+
+#include "stm32_hal.h"
+
+#include "eeprom.h"
+
+
+int8_t eeprom_read(uint32_t offset, uint8_t *data, uint32_t length)
+{
+	return -1;
+}
+
+int8_t eeprom_write(uint32_t offset, uint8_t *data, uint32_t length)
+{
+	return -1;
+}
+
+int8_t eeprom_erase(void)
+{
+	return -1;
+}
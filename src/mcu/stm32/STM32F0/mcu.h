@@ -29,6 +29,8 @@
 
 #define STORAGE_SIZE						0x13000
 #define STORAGE_PAGE_SIZE					512 // 2KB in words (sizeof(uint32_t))
+#define STORAGE_ERASED_WORD					0xFFFFFFFF // Erased flash reads as 1
+#define STORAGE_CACHE_PAGES					1 // 2KB, there is no room for more
 
 #define STORAGE_ROM_OFFSET					0x0
 #define STORAGE_ROM_SIZE					0xC00 // 12KB in words (sizeof(uint32_t))
@@ -36,6 +38,12 @@
 #define STORAGE_FS_OFFSET					0xC00
 #define STORAGE_FS_SIZE						0x4000 // 64KB in words (sizeof(uint32_t))
 
+/* No data EEPROM */
+#define EEPROM_SIZE						0
+
+/* Size of the USB mass storage buffer, multi-sector transfers are handled by chunks of that size */
+#define USB_MSC_MEDIA_PACKET					512 // bytes, one sector per transfer since RAM is scarce
+
 /* Sleep states related latencies */
 /* Sleep */
 #define ENTER_SLEEP_S1_LATENCY					5 // mcu_time_t ticks
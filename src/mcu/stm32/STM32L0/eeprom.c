@@ -0,0 +1,95 @@
+/*
+ * MCUGotchi - A Tamagotchi P1 emulator for microcontrollers
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdint.h>
+
+#include "stm32_hal.h"
+
+#include "eeprom.h"
+
+
+int8_t eeprom_read(uint32_t offset, uint8_t *data, uint32_t length)
+{
+	__IO uint8_t *ptr = (__IO uint8_t *) (EEPROM_BASE_ADDRESS + offset);
+
+	if (offset + length > EEPROM_SIZE) {
+		return -1;
+	}
+
+	while (length-- > 0) {
+		*(data++) = *(ptr++);
+	}
+
+	return 0;
+}
+
+int8_t eeprom_write(uint32_t offset, uint8_t *data, uint32_t length)
+{
+	uint32_t addr = EEPROM_BASE_ADDRESS + offset;
+	uint32_t word, new_word;
+	uint32_t shift;
+	HAL_StatusTypeDef status = HAL_OK;
+
+	if (offset + length > EEPROM_SIZE) {
+		return -1;
+	}
+
+	HAL_FLASHEx_DATAEEPROM_Unlock();
+
+	while (length > 0 && status == HAL_OK) {
+		/* Merge the bytes into the word they belong to */
+		word = *((__IO uint32_t *) (addr & ~0x3));
+		new_word = word;
+
+		do {
+			shift = (addr & 0x3) << 3;
+			new_word = (new_word & ~(0xFFUL << shift)) | ((uint32_t) *(data++) << shift);
+			addr++;
+			length--;
+		} while (length > 0 && (addr & 0x3));
+
+		/* Each write costs an erase/program cycle, unchanged words are skipped */
+		if (new_word != word) {
+			status = HAL_FLASHEx_DATAEEPROM_Program(FLASH_TYPEPROGRAMDATA_WORD, (addr - 1) & ~0x3, new_word);
+		}
+	}
+
+	HAL_FLASHEx_DATAEEPROM_Lock();
+
+	return (status == HAL_OK) ? 0 : -1;
+}
+
+int8_t eeprom_erase(void)
+{
+	uint32_t addr;
+
+	HAL_FLASHEx_DATAEEPROM_Unlock();
+
+	for (addr = EEPROM_BASE_ADDRESS; addr < EEPROM_BASE_ADDRESS + EEPROM_SIZE; addr += sizeof(uint32_t)) {
+		/* Erased words read as 0 */
+		if (*((__IO uint32_t *) addr) != 0 && HAL_FLASHEx_DATAEEPROM_Erase(addr) != HAL_OK) {
+			HAL_FLASHEx_DATAEEPROM_Lock();
+			return -1;
+		}
+	}
+
+	HAL_FLASHEx_DATAEEPROM_Lock();
+
+	return 0;
+}
@@ -29,6 +29,9 @@
 
 #define STORAGE_SIZE						0x13000
 #define STORAGE_PAGE_SIZE					32 // 128B in words (sizeof(uint32_t))
+#define STORAGE_HALF_PAGE_SIZE					16 // 64B in words (sizeof(uint32_t)), programmed at once
+#define STORAGE_ERASED_WORD					0x00000000 // Erased flash reads as 0
+#define STORAGE_CACHE_PAGES					8 // 1KB, a FAT sector and a directory sector
 
 #define STORAGE_ROM_OFFSET					0x0
 #define STORAGE_ROM_SIZE					0xC00 // 12KB in words (sizeof(uint32_t))
@@ -36,6 +39,13 @@
 #define STORAGE_FS_OFFSET					0xC00
 #define STORAGE_FS_SIZE						0x4000 // 64KB in words (sizeof(uint32_t))
 
+/* Data EEPROM related offsets and sizes */
+#define EEPROM_BASE_ADDRESS					0x08080000
+#define EEPROM_SIZE						0x1800 // 6KB in bytes
+
+/* Size of the USB mass storage buffer, multi-sector transfers are handled by chunks of that size */
+#define USB_MSC_MEDIA_PACKET					1024 // bytes, two sectors per transfer
+
 /* Sleep states related latencies */
 /* Sleep */
 #define ENTER_SLEEP_S1_LATENCY					5 // mcu_time_t ticks
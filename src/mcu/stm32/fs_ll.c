@@ -25,6 +25,9 @@
 
 #define STORAGE_BLK_SIZE				512
 
+/* Sectors are written straight to the flash instead of going through the page cache */
+//#define FS_LL_WRITE_THROUGH
+
 static FATFS storage_drv_fs;
 static char storage_drv_path[4];
 
@@ -44,7 +47,7 @@ static DSTATUS storage_drv_status(BYTE lun)
 
 static DRESULT storage_drv_read(BYTE lun, BYTE *buff, DWORD sector, UINT count)
 {
-	if (storage_read(STORAGE_FS_OFFSET + sector * (STORAGE_BLK_SIZE >> 2), (uint32_t *) buff, count * (STORAGE_BLK_SIZE >> 2)) < 0) {
+	if (fs_ll_read(sector, (uint32_t *) buff, count) < 0) {
 		return RES_ERROR;
 	}
 
@@ -54,7 +57,7 @@ static DRESULT storage_drv_read(BYTE lun, BYTE *buff, DWORD sector, UINT count)
 #if _USE_WRITE == 1
 static DRESULT storage_drv_write(BYTE lun, const BYTE *buff, DWORD sector, UINT count)
 {
-	if (storage_write(STORAGE_FS_OFFSET + sector * (STORAGE_BLK_SIZE >> 2), (uint32_t *) buff, count * (STORAGE_BLK_SIZE >> 2)) < 0) {
+	if (fs_ll_write(sector, (uint32_t *) buff, count) < 0) {
 		return RES_ERROR;
 	}
 
@@ -74,12 +77,12 @@ static DRESULT storage_drv_ioctl(BYTE lun, BYTE cmd, void *buff)
 	switch (cmd) {
 		/* Make sure that no pending write process */
 		case CTRL_SYNC :
-			res = RES_OK;
+			res = (fs_ll_sync() < 0) ? RES_ERROR : RES_OK;
 			break;
 
 		/* Get number of sectors on the disk (DWORD) */
 		case GET_SECTOR_COUNT :
-			*((DWORD*) buff) = (STORAGE_FS_SIZE << 2)/STORAGE_BLK_SIZE;
+			*((DWORD*) buff) = fs_ll_get_sector_count();
 			res = RES_OK;
 			break;
 
@@ -115,25 +118,180 @@ static Diskio_drvTypeDef storage_drv_driver = {
 #endif
 };
 
+int8_t fs_ll_read(uint32_t sector, uint32_t *data, uint32_t count)
+{
+#ifdef FTL_ENABLED
+	return ftl_read(sector, data, count);
+#else
+	return storage_read(STORAGE_FS_OFFSET + sector * (STORAGE_BLK_SIZE >> 2), data, count * (STORAGE_BLK_SIZE >> 2));
+#endif
+}
+
+int8_t fs_ll_write(uint32_t sector, uint32_t *data, uint32_t count)
+{
+#ifdef FTL_ENABLED
+	return ftl_write(sector, data, count);
+#else
+#ifdef FS_LL_WRITE_THROUGH
+	return storage_write(STORAGE_FS_OFFSET + sector * (STORAGE_BLK_SIZE >> 2), data, count * (STORAGE_BLK_SIZE >> 2));
+#else
+	return storage_write_cached(STORAGE_FS_OFFSET + sector * (STORAGE_BLK_SIZE >> 2), data, count * (STORAGE_BLK_SIZE >> 2));
+#endif
+#endif
+}
+
+int8_t fs_ll_sync(void)
+{
+	/* The FTL programs the sectors straight away */
+	return storage_flush();
+}
+
+uint32_t fs_ll_get_sector_count(void)
+{
+	return (STORAGE_FS_SIZE << 2)/STORAGE_BLK_SIZE;
+}
+
+const void * fs_ll_get_sector_address(uint32_t sector)
+{
+#ifdef FTL_ENABLED
+	/* Sectors are moved around */
+	return NULL;
+#else
+	if (sector >= fs_ll_get_sector_count()) {
+		return NULL;
+	}
+
+	return (const void *) (STORAGE_BASE_ADDRESS + ((STORAGE_FS_OFFSET + sector * (STORAGE_BLK_SIZE >> 2)) << 2));
+#endif
+}
+
+const void * fs_ll_get_read_address(uint32_t sector, uint32_t count)
+{
+	const void *addr = fs_ll_get_sector_address(sector);
+
+	if (addr == NULL || count == 0 || fs_ll_get_sector_address(sector + count - 1) == NULL) {
+		return NULL;
+	}
+
+#ifndef FTL_ENABLED
+	/* A cached page is more recent than the flash */
+	if (storage_is_dirty(STORAGE_FS_OFFSET + sector * (STORAGE_BLK_SIZE >> 2), count * (STORAGE_BLK_SIZE >> 2))) {
+		return NULL;
+	}
+#endif
+
+	return addr;
+}
+
 void fs_ll_init(void)
 {
+#ifdef FTL_ENABLED
+	ftl_init();
+#endif
+
 	if (FATFS_LinkDriver(&storage_drv_driver, storage_drv_path)) {
 		return;
 	}
 }
 
+#ifdef FTL_ENABLED
+static uint16_t get_fat12_entry(uint8_t *fat, uint32_t cluster)
+{
+	uint32_t offset = cluster + cluster/2;
+	uint16_t entry = fat[offset] | (fat[offset + 1] << 8);
+
+	return (cluster & 0x1) ? (entry >> 4) : (entry & 0xFFF);
+}
+
+static void set_fat12_entry(uint8_t *fat, uint32_t cluster, uint16_t value)
+{
+	uint32_t offset = cluster + cluster/2;
+
+	if (cluster & 0x1) {
+		fat[offset] = (fat[offset] & 0x0F) | ((value << 4) & 0xF0);
+		fat[offset + 1] = (value >> 4) & 0xFF;
+	} else {
+		fat[offset] = value & 0xFF;
+		fat[offset + 1] = (fat[offset + 1] & 0xF0) | ((value >> 8) & 0x0F);
+	}
+}
+
+/* The FTL holds less sectors than the volume has. The free clusters it cannot hold are
+ * marked as bad, so that neither FatFs nor the USB host count on them. This is checked
+ * at each mount, since the host might have formatted the volume again.
+ */
+static int8_t reserve_clusters(uint8_t *buf)
+{
+	FATFS *fs = &storage_drv_fs;
+	uint32_t usable, cluster;
+	uint8_t changed = 0;
+	uint8_t i;
+
+	if (fs->database + (fs->n_fatent - 2) * fs->csize <= FTL_CAPACITY) {
+		/* Nothing to do */
+		return 0;
+	}
+
+	/* A volume that small is always FAT12, with its whole FAT within the first sector */
+	if (fs->fs_type != FS_FAT12 || fs->database >= FTL_CAPACITY || fs->n_fatent + fs->n_fatent/2 + 1 > STORAGE_BLK_SIZE) {
+		return -1;
+	}
+
+	usable = (FTL_CAPACITY - fs->database)/fs->csize;
+
+	if (fs_ll_read(fs->fatbase, (uint32_t *) buf, 1) < 0) {
+		return -1;
+	}
+
+	/* Clusters already in use are left as is */
+	for (cluster = usable + 2; cluster < fs->n_fatent; cluster++) {
+		if (get_fat12_entry(buf, cluster) == 0) {
+			set_fat12_entry(buf, cluster, 0xFF7);
+			changed = 1;
+		}
+	}
+
+	if (!changed) {
+		return 0;
+	}
+
+	for (i = 0; i < fs->n_fats; i++) {
+		if (fs_ll_write(fs->fatbase + i * fs->fsize, (uint32_t *) buf, 1) < 0) {
+			return -1;
+		}
+	}
+
+	/* FatFs might have cached the previous FAT content */
+	if (f_mount(&storage_drv_fs, (TCHAR const*) storage_drv_path, 1) != FR_OK) {
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
 int8_t fs_ll_mount(void)
 {
-	BYTE work[_MAX_SS];
+	uint32_t work[_MAX_SS/sizeof(uint32_t)]; // word aligned, for fs_ll_read()
 
 	if (f_mount(&storage_drv_fs, (TCHAR const*) storage_drv_path, 1) != FR_OK) {
 		/* Format the storage if it is not valid (SFD mode) */
 		if (f_mkfs((TCHAR const*) storage_drv_path, FM_SFD | FM_FAT, 0, work, sizeof work) != FR_OK) {
 			return - 1;
 		}
+
+#ifdef FTL_ENABLED
+		if (f_mount(&storage_drv_fs, (TCHAR const*) storage_drv_path, 1) != FR_OK) {
+			return -1;
+		}
+#endif
 	}
 
+#ifdef FTL_ENABLED
+	return reserve_clusters((uint8_t *) work);
+#else
 	return 0;
+#endif
 }
 
 int8_t fs_ll_umount(void)
@@ -142,5 +300,9 @@ int8_t fs_ll_umount(void)
 		return -1;
 	}
 
+	if (fs_ll_sync() < 0) {
+		return -1;
+	}
+
 	return 0;
 }
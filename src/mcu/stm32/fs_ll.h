@@ -20,9 +20,27 @@
 #ifndef _FS_LL_H_
 #define _FS_LL_H_
 
+#include <stdint.h>
+
+#include "ftl.h"
+
 void fs_ll_init(void);
 
 int8_t fs_ll_mount(void);
 int8_t fs_ll_umount(void);
 
+/* Sector level access to the volume, shared by FatFs and the USB mass storage */
+int8_t fs_ll_read(uint32_t sector, uint32_t *data, uint32_t count);
+int8_t fs_ll_write(uint32_t sector, uint32_t *data, uint32_t count);
+int8_t fs_ll_sync(void);
+uint32_t fs_ll_get_sector_count(void);
+
+/* Memory-mapped address of a sector, or NULL if sectors do not have a fixed location */
+const void * fs_ll_get_sector_address(uint32_t sector);
+
+/* Same as fs_ll_get_sector_address(), but for sectors to be read straight from the flash.
+ * Returns NULL if any of them is not up to date in flash.
+ */
+const void * fs_ll_get_read_address(uint32_t sector, uint32_t count);
+
 #endif /* _FS_LL_H_ */
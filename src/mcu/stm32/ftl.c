@@ -0,0 +1,494 @@
+/*
+ * MCUGotchi - A Tamagotchi P1 emulator for microcontrollers
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdint.h>
+
+#include "stm32_hal.h"
+
+#include "time.h"
+#include "job.h"
+#include "storage.h"
+#include "ftl.h"
+
+#ifdef FTL_ENABLED
+
+/* Each block starts with a one slot header:
+ * word 0: magic
+ * word 1: erase count
+ * word 2: sequence number, programmed when the block gets allocated
+ * word 4+: tag of each slot, programmed after the slot data
+ */
+#define FTL_MAGIC					0x314C5446 // "FTL1"
+#define HDR_MAGIC					0
+#define HDR_ERASE_COUNT					1
+#define HDR_SEQUENCE					2
+#define HDR_TAGS					4
+
+/* A tag is neither 0x00000000 nor 0xFFFFFFFF, whatever the erased value is */
+#define TAG(s)						(((s) << 16) | (~(s) & 0xFFFF))
+
+#define NO_SECTOR					0xFF
+#define NO_BLOCK					0xFF
+
+#define WEAR_THRESHOLD					64 // erases
+#define GC_DELAY					1000 //ms
+
+#define BLOCK_OFFSET(b)					(STORAGE_FS_OFFSET + (b) * FTL_BLOCK_SIZE)
+#define SLOT_OFFSET(b, s)				(BLOCK_OFFSET(b) + ((s) + 1) * FTL_SECTOR_SIZE)
+#define FLASH_PTR(offset)				((__IO uint32_t *) (STORAGE_BASE_ADDRESS + ((offset) << 2)))
+
+typedef enum {
+	BLOCK_DIRTY = 0,
+	BLOCK_FREE,
+	BLOCK_USED,
+} block_state_t;
+
+typedef struct {
+	uint32_t erase_count;
+	uint32_t sequence;
+	block_state_t state;
+	uint8_t next_slot;
+	uint8_t live;
+} block_t;
+
+/* Location of each sector (block * FTL_SLOTS_PER_BLOCK + slot) */
+static uint8_t map[FTL_SECTOR_NUM];
+static block_t blocks[FTL_BLOCK_NUM];
+
+static uint8_t current_block = NO_BLOCK;
+static uint32_t last_sequence = 0;
+
+static job_t gc_job;
+
+
+static uint8_t is_blank(__IO uint32_t *ptr, uint32_t length)
+{
+	while (length-- > 0) {
+		if (*(ptr++) != STORAGE_ERASED_WORD) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static uint8_t is_equal(__IO uint32_t *ptr, uint32_t *data, uint32_t length)
+{
+	while (length-- > 0) {
+		if (*(ptr++) != *(data++)) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static uint8_t is_zero(uint32_t *data, uint32_t length)
+{
+	while (length-- > 0) {
+		if (*(data++) != 0) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static uint8_t count_free_blocks(void)
+{
+	uint8_t b, count = 0;
+
+	for (b = 0; b < FTL_BLOCK_NUM; b++) {
+		if (blocks[b].state == BLOCK_FREE) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static int8_t format_block(uint8_t b, uint32_t erase_count)
+{
+	uint32_t hdr[2] = {FTL_MAGIC, erase_count};
+
+	blocks[b].state = BLOCK_DIRTY;
+	blocks[b].erase_count = erase_count;
+	blocks[b].sequence = 0;
+	blocks[b].next_slot = 0;
+	blocks[b].live = 0;
+
+	if (storage_erase_pages(BLOCK_OFFSET(b), FTL_BLOCK_SIZE) < 0) {
+		return -1;
+	}
+
+	if (storage_program(BLOCK_OFFSET(b), hdr, 2) < 0) {
+		return -1;
+	}
+
+	blocks[b].state = BLOCK_FREE;
+
+	return 0;
+}
+
+static uint8_t allocate_block(void)
+{
+	uint8_t b, best = NO_BLOCK;
+	uint32_t sequence = last_sequence + 1;
+
+	/* Pick the least worn free block */
+	for (b = 0; b < FTL_BLOCK_NUM; b++) {
+		if (blocks[b].state == BLOCK_FREE && (best == NO_BLOCK || blocks[b].erase_count < blocks[best].erase_count)) {
+			best = b;
+		}
+	}
+
+	if (best == NO_BLOCK) {
+		return NO_BLOCK;
+	}
+
+	if (storage_program(BLOCK_OFFSET(best) + HDR_SEQUENCE, &sequence, 1) < 0) {
+		blocks[best].state = BLOCK_DIRTY;
+		return NO_BLOCK;
+	}
+
+	blocks[best].state = BLOCK_USED;
+	blocks[best].sequence = sequence;
+	last_sequence = sequence;
+
+	return best;
+}
+
+static int8_t program_sector(uint32_t sector, uint32_t *data)
+{
+	uint32_t tag = TAG(sector);
+	uint8_t b = current_block;
+	uint8_t s;
+
+	if (b == NO_BLOCK || blocks[b].next_slot >= FTL_SLOTS_PER_BLOCK) {
+		b = current_block = allocate_block();
+		if (b == NO_BLOCK) {
+			return -1;
+		}
+	}
+
+	/* The slot is consumed even if programming it fails */
+	s = blocks[b].next_slot++;
+
+	/* The tag is programmed last, an interrupted write is thus ignored at mount time */
+	if (storage_program(SLOT_OFFSET(b, s), data, FTL_SECTOR_SIZE) < 0) {
+		return -1;
+	}
+
+	if (storage_program(BLOCK_OFFSET(b) + HDR_TAGS + s, &tag, 1) < 0) {
+		return -1;
+	}
+
+	if (map[sector] != NO_SECTOR) {
+		blocks[map[sector] / FTL_SLOTS_PER_BLOCK].live--;
+	}
+
+	map[sector] = b * FTL_SLOTS_PER_BLOCK + s;
+	blocks[b].live++;
+
+	return 0;
+}
+
+static uint8_t select_victim(uint8_t coldest)
+{
+	uint8_t b, best = NO_BLOCK;
+
+	for (b = 0; b < FTL_BLOCK_NUM; b++) {
+		if (blocks[b].state != BLOCK_USED || b == current_block) {
+			continue;
+		}
+
+		if (best == NO_BLOCK) {
+			best = b;
+		} else if (coldest && blocks[b].erase_count < blocks[best].erase_count) {
+			best = b;
+		} else if (!coldest && blocks[b].live < blocks[best].live) {
+			best = b;
+		}
+	}
+
+	if (best != NO_BLOCK && !coldest && blocks[best].live >= FTL_SLOTS_PER_BLOCK) {
+		/* Nothing to reclaim */
+		return NO_BLOCK;
+	}
+
+	return best;
+}
+
+static int8_t collect_block(uint8_t b)
+{
+	uint32_t sector;
+	uint8_t loc;
+
+	/* Move the live sectors to the current block, straight from the flash */
+	for (sector = 0; sector < FTL_SECTOR_NUM && blocks[b].live > 0; sector++) {
+		loc = map[sector];
+
+		if (loc != NO_SECTOR && loc / FTL_SLOTS_PER_BLOCK == b) {
+			if (program_sector(sector, (uint32_t *) FLASH_PTR(SLOT_OFFSET(b, loc % FTL_SLOTS_PER_BLOCK))) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	/* The copies have a higher sequence number, thus a power loss from now on is harmless */
+	return format_block(b, blocks[b].erase_count + 1);
+}
+
+static int8_t collect_garbage(void)
+{
+	uint8_t b;
+
+	/* Keep enough free blocks to absorb the sectors moved by a collection */
+	while (count_free_blocks() < FTL_MIN_FREE_BLOCKS) {
+		b = select_victim(0);
+
+		if (b == NO_BLOCK || collect_block(b) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static uint32_t get_min_used_erase_count(void)
+{
+	uint32_t min = 0xFFFFFFFF;
+	uint8_t b;
+
+	for (b = 0; b < FTL_BLOCK_NUM; b++) {
+		if (blocks[b].state == BLOCK_USED && b != current_block && blocks[b].erase_count < min) {
+			min = blocks[b].erase_count;
+		}
+	}
+
+	return min;
+}
+
+static void gc_job_fn(job_t *job)
+{
+	uint8_t b = NO_BLOCK;
+	uint32_t min;
+
+	/* MSC writes are handled in the USB IRQ, which must not preempt the collection */
+	HAL_NVIC_DisableIRQ(USB_IRQn);
+
+	if (count_free_blocks() < FTL_SPARE_BLOCKS) {
+		/* Reclaim the stale sectors ahead of time */
+		b = select_victim(0);
+	} else {
+		/* Move the data that never changes out of the least worn blocks */
+		min = get_min_used_erase_count();
+
+		if (min != 0xFFFFFFFF && ftl_get_max_erase_count() - min > WEAR_THRESHOLD) {
+			b = select_victim(1);
+		}
+	}
+
+	/* One block at a time, not to delay the other jobs for too long */
+	if (b != NO_BLOCK && collect_block(b) == 0) {
+		job_schedule(&gc_job, &gc_job_fn, JOB_ASAP);
+	}
+
+	HAL_NVIC_EnableIRQ(USB_IRQn);
+}
+
+int8_t ftl_init(void)
+{
+	__IO uint32_t *hdr;
+	uint32_t max_erase_count = 0;
+	uint32_t sector, tag;
+	uint8_t b, s, loc;
+
+	for (sector = 0; sector < FTL_SECTOR_NUM; sector++) {
+		map[sector] = NO_SECTOR;
+	}
+
+	current_block = NO_BLOCK;
+	last_sequence = 0;
+
+	/* Read the block headers first, the sequence numbers are needed to find the most recent copy of a sector */
+	for (b = 0; b < FTL_BLOCK_NUM; b++) {
+		hdr = FLASH_PTR(BLOCK_OFFSET(b));
+
+		blocks[b].next_slot = 0;
+		blocks[b].live = 0;
+		blocks[b].sequence = 0;
+
+		if (hdr[HDR_MAGIC] != FTL_MAGIC) {
+			/* Never formatted, or interrupted while being erased */
+			blocks[b].state = BLOCK_DIRTY;
+			blocks[b].erase_count = 0;
+			continue;
+		}
+
+		blocks[b].erase_count = hdr[HDR_ERASE_COUNT];
+		if (blocks[b].erase_count > max_erase_count) {
+			max_erase_count = blocks[b].erase_count;
+		}
+
+		if (hdr[HDR_SEQUENCE] == STORAGE_ERASED_WORD) {
+			blocks[b].state = BLOCK_FREE;
+			continue;
+		}
+
+		blocks[b].state = BLOCK_USED;
+		blocks[b].sequence = hdr[HDR_SEQUENCE];
+		if (blocks[b].sequence > last_sequence) {
+			last_sequence = blocks[b].sequence;
+		}
+	}
+
+	for (b = 0; b < FTL_BLOCK_NUM; b++) {
+		if (blocks[b].state != BLOCK_USED) {
+			continue;
+		}
+
+		hdr = FLASH_PTR(BLOCK_OFFSET(b));
+
+		for (s = 0; s < FTL_SLOTS_PER_BLOCK; s++) {
+			tag = hdr[HDR_TAGS + s];
+
+			if (tag == STORAGE_ERASED_WORD) {
+				break;
+			}
+
+			sector = tag >> 16;
+			if (tag != TAG(sector) || sector >= FTL_SECTOR_NUM) {
+				/* Partially programmed tag */
+				continue;
+			}
+
+			/* Within a block, slots are programmed in order */
+			loc = map[sector];
+			if (loc != NO_SECTOR && loc / FTL_SLOTS_PER_BLOCK != b && blocks[loc / FTL_SLOTS_PER_BLOCK].sequence > blocks[b].sequence) {
+				continue;
+			}
+
+			if (loc != NO_SECTOR) {
+				blocks[loc / FTL_SLOTS_PER_BLOCK].live--;
+			}
+
+			map[sector] = b * FTL_SLOTS_PER_BLOCK + s;
+			blocks[b].live++;
+		}
+
+		blocks[b].next_slot = s;
+
+		/* Data without tag means that a write was interrupted, the slot cannot be reused */
+		if (s < FTL_SLOTS_PER_BLOCK && !is_blank(FLASH_PTR(SLOT_OFFSET(b, s)), FTL_SECTOR_SIZE)) {
+			blocks[b].next_slot = FTL_SLOTS_PER_BLOCK;
+		}
+
+		if (blocks[b].sequence == last_sequence && blocks[b].next_slot < FTL_SLOTS_PER_BLOCK) {
+			current_block = b;
+		}
+	}
+
+	/* The erase count of a block that lost its header is unknown, assume the worst */
+	for (b = 0; b < FTL_BLOCK_NUM; b++) {
+		if (blocks[b].state == BLOCK_DIRTY && format_block(b, max_erase_count) < 0) {
+			return -1;
+		}
+	}
+
+	/* A full volume can still be read */
+	collect_garbage();
+
+	return 0;
+}
+
+int8_t ftl_read(uint32_t sector, uint32_t *data, uint32_t count)
+{
+	uint32_t i;
+	uint8_t loc;
+
+	if (sector + count > FTL_SECTOR_NUM) {
+		return -1;
+	}
+
+	for (; count > 0; count--, sector++, data += FTL_SECTOR_SIZE) {
+		loc = map[sector];
+
+		if (loc == NO_SECTOR) {
+			/* Never written */
+			for (i = 0; i < FTL_SECTOR_SIZE; i++) {
+				data[i] = 0;
+			}
+
+			continue;
+		}
+
+		if (storage_read(SLOT_OFFSET(loc / FTL_SLOTS_PER_BLOCK, loc % FTL_SLOTS_PER_BLOCK), data, FTL_SECTOR_SIZE) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int8_t ftl_write(uint32_t sector, uint32_t *data, uint32_t count)
+{
+	uint8_t loc;
+
+	if (sector + count > FTL_SECTOR_NUM) {
+		return -1;
+	}
+
+	for (; count > 0; count--, sector++, data += FTL_SECTOR_SIZE) {
+		loc = map[sector];
+
+		/* FatFs and USB hosts often rewrite identical sectors, and unmapped sectors read as zeros */
+		if (loc == NO_SECTOR ? is_zero(data, FTL_SECTOR_SIZE) : is_equal(FLASH_PTR(SLOT_OFFSET(loc / FTL_SLOTS_PER_BLOCK, loc % FTL_SLOTS_PER_BLOCK)), data, FTL_SECTOR_SIZE)) {
+			continue;
+		}
+
+		if (program_sector(sector, data) < 0) {
+			return -1;
+		}
+
+		/* A failed collection means that the volume is full, the next write will report it */
+		collect_garbage();
+	}
+
+	/* The remaining stale sectors are reclaimed once idle */
+	job_schedule(&gc_job, &gc_job_fn, time_get() + MS_TO_MCU_TIME(GC_DELAY));
+
+	return 0;
+}
+
+uint32_t ftl_get_max_erase_count(void)
+{
+	uint32_t max = 0;
+	uint8_t b;
+
+	for (b = 0; b < FTL_BLOCK_NUM; b++) {
+		if (blocks[b].state != BLOCK_DIRTY && blocks[b].erase_count > max) {
+			max = blocks[b].erase_count;
+		}
+	}
+
+	return max;
+}
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * MCUGotchi - A Tamagotchi P1 emulator for microcontrollers
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef _FTL_H_
+#define _FTL_H_
+
+#include <stdint.h>
+
+#include "storage.h"
+
+/* Define this to remap the FAT sectors onto a rotating pool of flash blocks.
+ * Enabling it changes the on-flash layout, thus the volume gets formatted again.
+ */
+//#define FTL_ENABLED
+
+#define FTL_SECTOR_SIZE					128 // words (512 B)
+#define FTL_BLOCK_SIZE					1024 // words (4 KB), must be a multiple of STORAGE_PAGE_SIZE
+#define FTL_SLOTS_PER_BLOCK				(FTL_BLOCK_SIZE/FTL_SECTOR_SIZE - 1) // The first slot holds the header
+#define FTL_BLOCK_NUM					(STORAGE_FS_SIZE/FTL_BLOCK_SIZE)
+#define FTL_MIN_FREE_BLOCKS				2 // Free blocks needed to absorb the sectors moved by a collection
+#define FTL_SPARE_BLOCKS				3 // Free blocks kept by the idle garbage collection
+
+/* The volume keeps its size (FatFs needs at least 128 sectors), but only FTL_CAPACITY sectors
+ * can be stored at once. Never written (or zero-filled) sectors do not take any space, and the
+ * clusters beyond the capacity are marked as bad when mounting, leaving about 32 KB for files.
+ */
+#define FTL_SECTOR_NUM					(STORAGE_FS_SIZE/FTL_SECTOR_SIZE)
+#define FTL_CAPACITY					((FTL_BLOCK_NUM - FTL_MIN_FREE_BLOCKS) * FTL_SLOTS_PER_BLOCK)
+
+#ifdef FTL_ENABLED
+int8_t ftl_init(void);
+
+int8_t ftl_read(uint32_t sector, uint32_t *data, uint32_t count);
+int8_t ftl_write(uint32_t sector, uint32_t *data, uint32_t count);
+
+/* Erase count of the most worn block */
+uint32_t ftl_get_max_erase_count(void);
+#endif
+
+#endif /* _FTL_H_ */
@@ -23,6 +23,25 @@
 
 #include "storage.h"
 
+#define PAGE_SIZE_U8					(STORAGE_PAGE_SIZE << 2)
+
+#ifndef STORAGE_CACHE_PAGES
+#define STORAGE_CACHE_PAGES				1
+#endif
+
+#if STORAGE_CACHE_PAGES > 8
+#error "STORAGE_CACHE_PAGES cannot be greater than 8"
+#endif
+
+/* Pages cached by storage_write_cached(), they are too big to live on the stack.
+ * The first one is also the scratch buffer of storage_write(), once everything is written back.
+ */
+static uint32_t cache[STORAGE_CACHE_PAGES][STORAGE_PAGE_SIZE];
+static uint32_t cache_addr[STORAGE_CACHE_PAGES];
+static uint32_t cache_stamp[STORAGE_CACHE_PAGES];
+static uint32_t cache_clock = 0;
+static uint8_t cache_dirty = 0; // One bit per cached page, only dirty pages are kept
+
 
 static void flash_read(uint32_t addr, uint32_t *data, uint32_t length)
 {
@@ -33,16 +52,55 @@ static void flash_read(uint32_t addr, uint32_t *data, uint32_t length)
 	}
 }
 
+#ifdef STORAGE_HALF_PAGE_SIZE
+static uint8_t is_erased(uint32_t *data, uint32_t length)
+{
+	while (length-- > 0) {
+		if (*(data++) != STORAGE_ERASED_WORD) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+#endif
+
 static int8_t flash_write(uint32_t addr, uint32_t *data, uint32_t length)
 {
 	__IO uint32_t *ptr = (__IO uint32_t *) addr;
 	HAL_StatusTypeDef status;
 
+#ifdef STORAGE_HALF_PAGE_SIZE
+	/* Aligned half-pages are programmed at once, for about the cost of a single word.
+	 * The flash cannot be read meanwhile, thus the data must be in RAM.
+	 */
+	if ((uint32_t) data >= SRAM_BASE) {
+		while (length >= STORAGE_HALF_PAGE_SIZE && !(((uint32_t) ptr) & ((STORAGE_HALF_PAGE_SIZE << 2) - 1))) {
+			if (!is_erased(data, STORAGE_HALF_PAGE_SIZE)) {
+				status = HAL_FLASHEx_HalfPageProgram((uint32_t) ptr, data);
+				if (status != HAL_OK) {
+					return -1;
+				}
+			}
+
+			ptr += STORAGE_HALF_PAGE_SIZE;
+			data += STORAGE_HALF_PAGE_SIZE;
+			length -= STORAGE_HALF_PAGE_SIZE;
+		}
+	}
+#endif
+
 	while (length-- > 0) {
-		status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, (uint32_t) (ptr++), (uint32_t) *(data++));
-		if (status != HAL_OK) {
-			return -1;
+		/* Erased words do not need to be programmed */
+		if (*data != STORAGE_ERASED_WORD) {
+			status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, (uint32_t) ptr, (uint32_t) *data);
+			if (status != HAL_OK) {
+				return -1;
+			}
 		}
+
+		ptr++;
+		data++;
 	}
 
 	return 0;
@@ -61,6 +119,29 @@ static int16_t flash_erase_page(uint32_t addr)
 	return (HAL_FLASHEx_Erase(&erase_init, &error) == HAL_OK ? 0 : -1);
 }
 
+static void overlay_cached_pages(uint32_t addr, uint32_t *data, uint32_t length)
+{
+	uint32_t start, end;
+	uint8_t i;
+
+	for (i = 0; i < STORAGE_CACHE_PAGES; i++) {
+		if (!(cache_dirty & (1 << i))) {
+			continue;
+		}
+
+		start = (addr > cache_addr[i]) ? addr : cache_addr[i];
+		end = addr + (length << 2);
+
+		if (end > cache_addr[i] + PAGE_SIZE_U8) {
+			end = cache_addr[i] + PAGE_SIZE_U8;
+		}
+
+		for (; start < end; start += sizeof(uint32_t)) {
+			data[(start - addr) >> 2] = cache[i][(start - cache_addr[i]) >> 2];
+		}
+	}
+}
+
 int8_t storage_read(uint32_t offset, uint32_t *data, uint32_t length)
 {
 	if (length == 0) {
@@ -74,28 +155,67 @@ int8_t storage_read(uint32_t offset, uint32_t *data, uint32_t length)
 
 	flash_read(STORAGE_BASE_ADDRESS + (offset << 2), data, length);
 
+	/* The cached pages are more recent than the flash */
+	if (cache_dirty) {
+		overlay_cached_pages(STORAGE_BASE_ADDRESS + (offset << 2), data, length);
+	}
+
 	return 0;
 }
 
-static int8_t write_within_page(uint32_t addr, uint32_t *data, uint32_t length)
+static int8_t write_within_page(uint32_t addr, uint32_t *data, uint32_t length, uint32_t *page)
 {
-	uint32_t page[STORAGE_PAGE_SIZE];
-	uint32_t page_addr = addr & ~((STORAGE_PAGE_SIZE << 2) - 1);
+	uint32_t page_addr = addr & ~(PAGE_SIZE_U8 - 1);
 	uint32_t offset_in_page = (addr >> 2) & (STORAGE_PAGE_SIZE - 1);
+	__IO uint32_t *ptr = (__IO uint32_t *) addr;
+	uint8_t changed = 0;
+	uint8_t blank = 1;
 	uint32_t i = 0;
 
 	if (length > STORAGE_PAGE_SIZE - offset_in_page) {
 		return -1;
 	}
 
-	/* Read the page if needed */
-	if (offset_in_page != 0 ||  length < STORAGE_PAGE_SIZE) {
-		flash_read(page_addr, page, STORAGE_PAGE_SIZE);
+	/* Compare the data with the flash content, FatFs and USB hosts often
+	 * rewrite identical sectors, and already erased words can be programmed
+	 * without erasing the whole page
+	 */
+	for (i = 0; i < length; i++) {
+		if (ptr[i] != data[i]) {
+			changed = 1;
+
+			if (ptr[i] != STORAGE_ERASED_WORD) {
+				blank = 0;
+				break;
+			}
+		}
+	}
+
+	if (!changed) {
+		/* Nothing to do */
+		return 0;
 	}
 
-	/* Update the page */
-	for (i = 0; i < length; i++) {
-		page[offset_in_page + i] = data[i];
+	if (blank) {
+		/* Only program the words that differ */
+		for (i = 0; i < length; i++) {
+			if (ptr[i] != data[i] && flash_write(addr + (i << 2), &data[i], 1) < 0) {
+				return -1;
+			}
+		}
+
+		return 0;
+	}
+
+	/* Read the parts of the page that are not updated */
+	flash_read(page_addr, page, offset_in_page);
+	flash_read(addr + (length << 2), &page[offset_in_page + length], STORAGE_PAGE_SIZE - offset_in_page - length);
+
+	/* Update the page (the data might already be staged in the page buffer) */
+	if (data != &page[offset_in_page]) {
+		for (i = 0; i < length; i++) {
+			page[offset_in_page + i] = data[i];
+		}
 	}
 
 	/* Erase the page */
@@ -116,6 +236,11 @@ int8_t storage_write(uint32_t offset, uint32_t *data, uint32_t length)
 	uint32_t page_len;
 	uint32_t addr = STORAGE_BASE_ADDRESS + (offset << 2);
 
+	/* The page buffer is needed, thus the cached pages must be written back first */
+	if (storage_flush() < 0) {
+		return -1;
+	}
+
 	HAL_FLASH_Unlock();
 
 	while (length > 0) {
@@ -127,7 +252,7 @@ int8_t storage_write(uint32_t offset, uint32_t *data, uint32_t length)
 			page_len = length;
 		}
 
-		if (write_within_page(addr, data, page_len) < 0) {
+		if (write_within_page(addr, data, page_len, cache[0]) < 0) {
 			HAL_FLASH_Lock();
 			return -1;
 		}
@@ -142,14 +267,211 @@ int8_t storage_write(uint32_t offset, uint32_t *data, uint32_t length)
 	return 0;
 }
 
+static int8_t flush_cached_page(uint8_t i)
+{
+	int8_t ret;
+
+	HAL_FLASH_Unlock();
+	ret = write_within_page(cache_addr[i], cache[i], STORAGE_PAGE_SIZE, cache[i]);
+	HAL_FLASH_Lock();
+
+	/* Dropped even on failure, the flash content cannot be trusted anymore */
+	cache_dirty &= ~(1 << i);
+
+	return ret;
+}
+
+static int8_t get_cached_page(uint32_t page_addr)
+{
+	uint8_t i, lru = 0;
+
+	for (i = 0; i < STORAGE_CACHE_PAGES; i++) {
+		if ((cache_dirty & (1 << i)) && cache_addr[i] == page_addr) {
+			return i;
+		}
+	}
+
+	/* Take a free entry, or write back the least recently written page */
+	for (i = 0; i < STORAGE_CACHE_PAGES; i++) {
+		if (!(cache_dirty & (1 << i))) {
+			lru = i;
+			break;
+		}
+
+		if (cache_stamp[i] < cache_stamp[lru]) {
+			lru = i;
+		}
+	}
+
+	if ((cache_dirty & (1 << lru)) && flush_cached_page(lru) < 0) {
+		return -1;
+	}
+
+	cache_addr[lru] = page_addr;
+	flash_read(page_addr, cache[lru], STORAGE_PAGE_SIZE);
+
+	return lru;
+}
+
+int8_t storage_write_cached(uint32_t offset, uint32_t *data, uint32_t length)
+{
+	uint32_t page_len;
+	uint32_t addr = STORAGE_BASE_ADDRESS + (offset << 2);
+	uint32_t offset_in_page;
+	uint32_t i;
+	int8_t entry;
+
+	if ((offset + length) * sizeof(uint32_t) > STORAGE_SIZE) {
+		return -1;
+	}
+
+	while (length > 0) {
+		offset_in_page = (addr >> 2) & (STORAGE_PAGE_SIZE - 1);
+
+		/* Either a first partial page or a full page */
+		page_len = STORAGE_PAGE_SIZE - offset_in_page;
+
+		if (page_len > length) {
+			/* Partial page */
+			page_len = length;
+		}
+
+		entry = get_cached_page(addr & ~(PAGE_SIZE_U8 - 1));
+		if (entry < 0) {
+			return -1;
+		}
+
+		for (i = 0; i < page_len; i++) {
+			cache[entry][offset_in_page + i] = data[i];
+		}
+
+		cache_dirty |= (1 << entry);
+		cache_stamp[entry] = ++cache_clock;
+
+		addr += page_len << 2;
+		data += page_len;
+		length -= page_len;
+	}
+
+	return 0;
+}
+
+int8_t storage_flush(void)
+{
+	int8_t ret = 0;
+	uint8_t i;
+
+	for (i = 0; i < STORAGE_CACHE_PAGES; i++) {
+		if ((cache_dirty & (1 << i)) && flush_cached_page(i) < 0) {
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+uint8_t storage_is_dirty(uint32_t offset, uint32_t length)
+{
+	uint32_t addr = STORAGE_BASE_ADDRESS + (offset << 2);
+
+	uint8_t i;
+
+	for (i = 0; i < STORAGE_CACHE_PAGES; i++) {
+		if ((cache_dirty & (1 << i)) && addr < cache_addr[i] + PAGE_SIZE_U8 && addr + (length << 2) > cache_addr[i]) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int8_t storage_program(uint32_t offset, uint32_t *data, uint32_t length)
+{
+	__IO uint32_t *ptr = (__IO uint32_t *) (STORAGE_BASE_ADDRESS + (offset << 2));
+	uint32_t i;
+	int8_t ret = 0;
+
+	if ((offset + length) * sizeof(uint32_t) > STORAGE_SIZE) {
+		return -1;
+	}
+
+	/* Make sure the cached pages cannot overwrite the programmed words later on */
+	if (storage_flush() < 0) {
+		return -1;
+	}
+
+	/* Words that are not erased cannot be changed without erasing the whole page */
+	for (i = 0; i < length; i++) {
+		if (ptr[i] != data[i] && ptr[i] != STORAGE_ERASED_WORD) {
+			return -1;
+		}
+	}
+
+	HAL_FLASH_Unlock();
+
+	for (i = 0; i < length; i++) {
+		if (ptr[i] != data[i] && flash_write((uint32_t) &ptr[i], &data[i], 1) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	HAL_FLASH_Lock();
+
+	return ret;
+}
+
+int8_t storage_erase_pages(uint32_t offset, uint32_t length)
+{
+	uint32_t addr = STORAGE_BASE_ADDRESS + (offset << 2);
+	uint8_t i;
+
+	if ((offset & (STORAGE_PAGE_SIZE - 1)) || (length & (STORAGE_PAGE_SIZE - 1)) || (offset + length) * sizeof(uint32_t) > STORAGE_SIZE) {
+		return -1;
+	}
+
+	/* Drop the cached pages that are erased */
+	for (i = 0; i < STORAGE_CACHE_PAGES; i++) {
+		if (cache_addr[i] >= addr && cache_addr[i] < addr + (length << 2)) {
+			cache_dirty &= ~(1 << i);
+		}
+	}
+
+	HAL_FLASH_Unlock();
+
+	for (; length > 0; length -= STORAGE_PAGE_SIZE) {
+		if (flash_erase_page(addr) < 0) {
+			HAL_FLASH_Lock();
+			return -1;
+		}
+
+		addr += PAGE_SIZE_U8;
+	}
+
+	HAL_FLASH_Lock();
+
+	return 0;
+}
+
+uint32_t * storage_get_page_buffer(void)
+{
+	/* The caller now owns the buffer */
+	storage_flush();
+
+	return cache[0];
+}
+
 int8_t storage_erase(void)
 {
 	uint32_t i;
 
+	/* Drop the cached pages */
+	cache_dirty = 0;
+
 	HAL_FLASH_Unlock();
 
 	for (i = 0; i < (STORAGE_SIZE >> 2)/STORAGE_PAGE_SIZE; i++) {
-		if (flash_erase_page(STORAGE_BASE_ADDRESS + i * (STORAGE_PAGE_SIZE << 2)) < 0) {
+		if (flash_erase_page(STORAGE_BASE_ADDRESS + i * PAGE_SIZE_U8) < 0) {
 			HAL_FLASH_Lock();
 			return -1;
 		}
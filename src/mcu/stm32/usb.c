@@ -22,20 +22,29 @@
 #include "usbd_core.h"
 #include "usbd_desc.h"
 #include "usbd_msc.h"
+#include "usbd_link.h"
 
 #include "system.h"
-#include "storage.h"
+#include "time.h"
+#include "job.h"
 #include "usb.h"
+#include "fs_ll.h"
+#include "link.h"
 
 #define STORAGE_LUN_NBR					1
 #define STORAGE_BLK_NBR					0x10000
 #define STORAGE_BLK_SIZE				512
 
+#define FLUSH_DELAY					500 //ms
+
 static USBD_HandleTypeDef USBD_Device;
 extern PCD_HandleTypeDef g_hpcd;
 
 static uint8_t state_lock = 0;
 
+static job_t flush_job;
+static job_t link_job;
+
 static int8_t msc_inquiry_data[] = { /* 36 */
 	/* LUN 0 */
 	0x00,
@@ -60,7 +69,7 @@ static int8_t msc_init(uint8_t lun)
 
 static int8_t msc_get_capacity(uint8_t lun, uint32_t *block_num, uint16_t *block_size)
 {
-	*block_num = (STORAGE_FS_SIZE << 2)/STORAGE_BLK_SIZE;
+	*block_num = fs_ll_get_sector_count();
 	*block_size = STORAGE_BLK_SIZE;
 
 	return 0;
@@ -78,12 +87,49 @@ static int8_t msc_is_write_protected(uint8_t lun)
 
 static int8_t msc_read(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
 {
-	return storage_read(STORAGE_FS_OFFSET + blk_addr * (STORAGE_BLK_SIZE >> 2), (uint32_t *) buf, blk_len * (STORAGE_BLK_SIZE >> 2));
+	const uint8_t *addr = fs_ll_get_read_address(blk_addr, blk_len);
+
+	if (addr != NULL) {
+		/* The class buffer is about to be transmitted, the data is sent straight from the flash instead */
+		USBD_LL_SetTransmitAlias(buf, addr);
+		return 0;
+	}
+
+	return fs_ll_read(blk_addr, (uint32_t *) buf, blk_len);
+}
+
+static void flush_job_fn(job_t *job)
+{
+	/* Writes are handled in the USB IRQ, which must not preempt the flush */
+	HAL_NVIC_DisableIRQ(USB_IRQn);
+	fs_ll_sync();
+	HAL_NVIC_EnableIRQ(USB_IRQn);
 }
 
 static int8_t msc_write(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
 {
-	return storage_write(STORAGE_FS_OFFSET + blk_addr * (STORAGE_BLK_SIZE >> 2), (uint32_t *) buf, blk_len * (STORAGE_BLK_SIZE >> 2));
+	/* Consecutive sectors are coalesced in the storage cache, which is written back once the host is idle */
+	job_schedule(&flush_job, &flush_job_fn, time_get() + MS_TO_MCU_TIME(FLUSH_DELAY));
+
+	return fs_ll_write(blk_addr, (uint32_t *) buf, blk_len);
+}
+
+static void link_job_fn(job_t *job)
+{
+	/* The request is executed outside of the USB IRQ, which must not preempt it */
+	HAL_NVIC_DisableIRQ(USB_IRQn);
+	link_process();
+	HAL_NVIC_EnableIRQ(USB_IRQn);
+}
+
+static void link_request(void)
+{
+	job_schedule(&link_job, &link_job_fn, JOB_ASAP);
+}
+
+static void link_write(uint8_t *data, uint16_t length)
+{
+	USBD_LINK_Transmit(&USBD_Device, data, length);
 }
 
 static int8_t msc_get_max_lun(void)
@@ -105,12 +151,18 @@ static USBD_StorageTypeDef usbd_disk_fops = {
 void usb_init(void)
 {
 	USBD_Init(&USBD_Device, &MSC_Desc, 0);
-	USBD_RegisterClass(&USBD_Device, USBD_MSC_CLASS);
+	USBD_RegisterClass(&USBD_Device, USBD_LINK_CLASS);
 	USBD_MSC_RegisterStorage(&USBD_Device, &usbd_disk_fops);
+
+	/* The link protocol shares the device with the mass storage */
+	USBD_LINK_RegisterRequestCallback(&link_request);
+	link_set_transport(&link_write);
 }
 
 void usb_deinit(void)
 {
+	USBD_LL_SetTransmitAlias(NULL, NULL);
+	link_set_transport(NULL);
 	USBD_DeInit(&USBD_Device);
 }
 
@@ -126,6 +178,11 @@ void usb_stop(void)
 {
 	USBD_Stop(&USBD_Device);
 
+	/* Write back any pending data */
+	job_cancel(&link_job);
+	job_cancel(&flush_job);
+	fs_ll_sync();
+
 	system_unlock_max_state(STATE_SLEEP_S1, &state_lock);
 }
 
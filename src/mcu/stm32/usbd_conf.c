@@ -21,12 +21,16 @@
 #include "stm32_hal.h"
 #include "usbd_core.h"
 #include "usbd_msc.h"
+#include "usbd_link.h"
 #include "time.h"
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
 /* Private macro -------------------------------------------------------------*/
 /* Private variables ---------------------------------------------------------*/
 PCD_HandleTypeDef g_hpcd;
+/* The next transmission from tx_alias_buf is sent from tx_alias_data instead */
+static uint8_t *tx_alias_buf = NULL;
+static uint8_t *tx_alias_data = NULL;
 /* Private function prototypes -----------------------------------------------*/
 /* Private functions ---------------------------------------------------------*/
 
@@ -207,6 +211,8 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
   HAL_PCDEx_PMAConfig(&g_hpcd , 0x80 , PCD_SNG_BUF, 0x58);
   HAL_PCDEx_PMAConfig(&g_hpcd , MSC_EPIN_ADDR , PCD_SNG_BUF, 0x98);
   HAL_PCDEx_PMAConfig(&g_hpcd , MSC_EPOUT_ADDR , PCD_SNG_BUF, 0xD8);
+  HAL_PCDEx_PMAConfig(&g_hpcd , LINK_EPIN_ADDR , PCD_SNG_BUF, 0x118);
+  HAL_PCDEx_PMAConfig(&g_hpcd , LINK_EPOUT_ADDR , PCD_SNG_BUF, 0x158);
 
   return USBD_OK;
 }
@@ -358,10 +364,30 @@ USBD_StatusTypeDef USBD_LL_Transmit(USBD_HandleTypeDef *pdev,
                                     uint8_t *pbuf,
                                     uint16_t size)
 {
+  if (tx_alias_buf != NULL && pbuf == tx_alias_buf)
+  {
+    /* The PMA is filled straight from the aliased data */
+    pbuf = tx_alias_data;
+    tx_alias_buf = NULL;
+  }
+
   HAL_PCD_EP_Transmit((PCD_HandleTypeDef*)pdev->pData, ep_addr, pbuf, size);
   return USBD_OK;
 }
 
+/**
+  * @brief  Sets the data to send on the next transmission from a given buffer.
+  *         This allows the class buffer not to be filled at all.
+  * @param  pbuf: Buffer that would have been transmitted, or NULL to cancel
+  * @param  data: Data to send instead, must remain valid until sent
+  * @retval None
+  */
+void USBD_LL_SetTransmitAlias(uint8_t *pbuf, const uint8_t *data)
+{
+  tx_alias_buf = pbuf;
+  tx_alias_data = (uint8_t *) data;
+}
+
 /**
   * @brief  Prepares an endpoint for reception.
   * @param  pdev: Device handle
@@ -23,6 +23,7 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "stm32_hal.h"
+#include "mcu.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,7 +31,7 @@
 /* Exported types ------------------------------------------------------------*/
 /* Exported constants --------------------------------------------------------*/
 /* Common Config */
-#define USBD_MAX_NUM_INTERFACES               1
+#define USBD_MAX_NUM_INTERFACES               2
 #define USBD_MAX_NUM_CONFIGURATION            1
 #define USBD_MAX_STR_DESC_SIZ                 0x100
 #define USBD_SUPPORT_USER_STRING_DESC         0
@@ -38,7 +39,7 @@
 #define USBD_DEBUG_LEVEL                      0
 
 /* MSC Class Config */
-#define MSC_MEDIA_PACKET                      512
+#define MSC_MEDIA_PACKET                      USB_MSC_MEDIA_PACKET
 
 /* Exported macro ------------------------------------------------------------*/
 /* Memory management macros */
@@ -49,7 +50,7 @@
 void *USBD_static_malloc(uint32_t size);
 void USBD_static_free(void *p);
 
-#define MAX_STATIC_ALLOC_SIZE     155 /* MSC Class Driver Structure size */
+#define MAX_STATIC_ALLOC_SIZE     ((MSC_MEDIA_PACKET >> 2) + 27) /* MSC Class Driver Structure size, in words */
 
 #define USBD_malloc               (uint32_t *)USBD_static_malloc
 #define USBD_free                 USBD_static_free
@@ -83,6 +84,7 @@ void USBD_static_free(void *p);
 #endif
 
 /* Exported functions ------------------------------------------------------- */
+void USBD_LL_SetTransmitAlias(uint8_t *pbuf, const uint8_t *data);
 
 #endif /* __USBD_CONF_H */
 
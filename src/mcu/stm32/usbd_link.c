@@ -0,0 +1,235 @@
+/*
+ * MCUGotchi - A Tamagotchi P1 emulator for microcontrollers
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "usbd_msc.h"
+#include "usbd_ctlreq.h"
+#include "usbd_link.h"
+
+#include "link.h"
+
+#define CFG_DESC_SIZE					(9 + 2 * (9 + 7 + 7))
+
+static uint8_t cfg_desc[CFG_DESC_SIZE] = {
+	0x09,						/* bLength */
+	USB_DESC_TYPE_CONFIGURATION,			/* bDescriptorType */
+	LOBYTE(CFG_DESC_SIZE),				/* wTotalLength */
+	HIBYTE(CFG_DESC_SIZE),
+	0x02,						/* bNumInterfaces */
+	0x01,						/* bConfigurationValue */
+	0x04,						/* iConfiguration */
+	0xC0,						/* bmAttributes: self powered */
+	0x32,						/* MaxPower 100 mA */
+
+	/* Mass Storage interface */
+	0x09,						/* bLength */
+	USB_DESC_TYPE_INTERFACE,			/* bDescriptorType */
+	0x00,						/* bInterfaceNumber */
+	0x00,						/* bAlternateSetting */
+	0x02,						/* bNumEndpoints */
+	0x08,						/* bInterfaceClass: MSC */
+	0x06,						/* bInterfaceSubClass: SCSI transparent */
+	0x50,						/* bInterfaceProtocol: BOT */
+	0x05,						/* iInterface */
+
+	0x07,						/* bLength */
+	USB_DESC_TYPE_ENDPOINT,				/* bDescriptorType */
+	MSC_EPIN_ADDR,					/* bEndpointAddress */
+	0x02,						/* bmAttributes: bulk */
+	LOBYTE(MSC_MAX_FS_PACKET),			/* wMaxPacketSize */
+	HIBYTE(MSC_MAX_FS_PACKET),
+	0x00,						/* bInterval */
+
+	0x07,						/* bLength */
+	USB_DESC_TYPE_ENDPOINT,				/* bDescriptorType */
+	MSC_EPOUT_ADDR,					/* bEndpointAddress */
+	0x02,						/* bmAttributes: bulk */
+	LOBYTE(MSC_MAX_FS_PACKET),			/* wMaxPacketSize */
+	HIBYTE(MSC_MAX_FS_PACKET),
+	0x00,						/* bInterval */
+
+	/* Link interface */
+	0x09,						/* bLength */
+	USB_DESC_TYPE_INTERFACE,			/* bDescriptorType */
+	LINK_INTERFACE,					/* bInterfaceNumber */
+	0x00,						/* bAlternateSetting */
+	0x02,						/* bNumEndpoints */
+	0xFF,						/* bInterfaceClass: vendor specific */
+	0x00,						/* bInterfaceSubClass */
+	0x00,						/* bInterfaceProtocol */
+	0x00,						/* iInterface */
+
+	0x07,						/* bLength */
+	USB_DESC_TYPE_ENDPOINT,				/* bDescriptorType */
+	LINK_EPIN_ADDR,					/* bEndpointAddress */
+	0x02,						/* bmAttributes: bulk */
+	LOBYTE(LINK_MAX_FS_PACKET),			/* wMaxPacketSize */
+	HIBYTE(LINK_MAX_FS_PACKET),
+	0x00,						/* bInterval */
+
+	0x07,						/* bLength */
+	USB_DESC_TYPE_ENDPOINT,				/* bDescriptorType */
+	LINK_EPOUT_ADDR,				/* bEndpointAddress */
+	0x02,						/* bmAttributes: bulk */
+	LOBYTE(LINK_MAX_FS_PACKET),			/* wMaxPacketSize */
+	HIBYTE(LINK_MAX_FS_PACKET),
+	0x00,						/* bInterval */
+};
+
+static uint8_t rx_packet[LINK_MAX_FS_PACKET];
+static uint8_t alt_setting = 0;
+
+static void (*request_cb)(void) = NULL;
+
+
+static uint8_t usbd_link_init(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
+{
+	uint8_t ret = USBD_MSC.Init(pdev, cfgidx);
+
+	USBD_LL_OpenEP(pdev, LINK_EPIN_ADDR, USBD_EP_TYPE_BULK, LINK_MAX_FS_PACKET);
+	USBD_LL_OpenEP(pdev, LINK_EPOUT_ADDR, USBD_EP_TYPE_BULK, LINK_MAX_FS_PACKET);
+
+	link_reset();
+	USBD_LL_PrepareReceive(pdev, LINK_EPOUT_ADDR, rx_packet, LINK_MAX_FS_PACKET);
+
+	return ret;
+}
+
+static uint8_t usbd_link_deinit(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
+{
+	USBD_LL_CloseEP(pdev, LINK_EPIN_ADDR);
+	USBD_LL_CloseEP(pdev, LINK_EPOUT_ADDR);
+
+	return USBD_MSC.DeInit(pdev, cfgidx);
+}
+
+static uint8_t is_link_request(USBD_SetupReqTypedef *req)
+{
+	switch (req->bmRequest & USB_REQ_RECIPIENT_MASK) {
+		case USB_REQ_RECIPIENT_INTERFACE:
+			return (LOBYTE(req->wIndex) == LINK_INTERFACE);
+
+		case USB_REQ_RECIPIENT_ENDPOINT:
+			return ((LOBYTE(req->wIndex) & 0x7F) == (LINK_EPOUT_ADDR & 0x7F));
+
+		default:
+			return 0;
+	}
+}
+
+static uint8_t usbd_link_setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
+{
+	/* Everything else belongs to the MSC interface */
+	if (!is_link_request(req)) {
+		return USBD_MSC.Setup(pdev, req);
+	}
+
+	/* No class or vendor request, the protocol only uses the bulk endpoints */
+	if ((req->bmRequest & USB_REQ_TYPE_MASK) != USB_REQ_TYPE_STANDARD) {
+		USBD_CtlError(pdev, req);
+		return USBD_FAIL;
+	}
+
+	switch (req->bRequest) {
+		case USB_REQ_GET_INTERFACE:
+			USBD_CtlSendData(pdev, &alt_setting, 1);
+			break;
+
+		case USB_REQ_SET_INTERFACE:
+		case USB_REQ_CLEAR_FEATURE:
+			/* The endpoints are never stalled */
+			break;
+
+		default:
+			USBD_CtlError(pdev, req);
+			return USBD_FAIL;
+	}
+
+	return USBD_OK;
+}
+
+static uint8_t usbd_link_data_in(USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+	if (epnum != (LINK_EPIN_ADDR & 0x7F)) {
+		return USBD_MSC.DataIn(pdev, epnum);
+	}
+
+	/* The response is sent, the next request can be received */
+	USBD_LL_PrepareReceive(pdev, LINK_EPOUT_ADDR, rx_packet, LINK_MAX_FS_PACKET);
+
+	return USBD_OK;
+}
+
+static uint8_t usbd_link_data_out(USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+	if (epnum != LINK_EPOUT_ADDR) {
+		return USBD_MSC.DataOut(pdev, epnum);
+	}
+
+	if (link_receive(rx_packet, USBD_LL_GetRxDataSize(pdev, epnum)) > 0) {
+		/* Nothing more is received until the response is sent */
+		if (request_cb != NULL) {
+			request_cb();
+		}
+	} else {
+		USBD_LL_PrepareReceive(pdev, LINK_EPOUT_ADDR, rx_packet, LINK_MAX_FS_PACKET);
+	}
+
+	return USBD_OK;
+}
+
+static uint8_t * usbd_link_get_cfg_desc(uint16_t *length)
+{
+	*length = sizeof(cfg_desc);
+	return cfg_desc;
+}
+
+static uint8_t * usbd_link_get_device_qualifier_desc(uint16_t *length)
+{
+	return USBD_MSC.GetDeviceQualifierDescriptor(length);
+}
+
+USBD_ClassTypeDef USBD_LINK = {
+	usbd_link_init,
+	usbd_link_deinit,
+	usbd_link_setup,
+	NULL, /* EP0_TxSent */
+	NULL, /* EP0_RxReady */
+	usbd_link_data_in,
+	usbd_link_data_out,
+	NULL, /* SOF */
+	NULL,
+	NULL,
+	usbd_link_get_cfg_desc,
+	usbd_link_get_cfg_desc,
+	usbd_link_get_cfg_desc,
+	usbd_link_get_device_qualifier_desc,
+};
+
+void USBD_LINK_RegisterRequestCallback(void (*cb)(void))
+{
+	request_cb = cb;
+}
+
+uint8_t USBD_LINK_Transmit(USBD_HandleTypeDef *pdev, uint8_t *buf, uint16_t length)
+{
+	return USBD_LL_Transmit(pdev, LINK_EPIN_ADDR, buf, length);
+}
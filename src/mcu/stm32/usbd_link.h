@@ -0,0 +1,43 @@
+/*
+ * MCUGotchi - A Tamagotchi P1 emulator for microcontrollers
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef _USBD_LINK_H_
+#define _USBD_LINK_H_
+
+#include "usbd_ioreq.h"
+
+/* Composite device made of the MSC interface and of a vendor interface carrying
+ * the link protocol over a pair of bulk endpoints
+ */
+#define LINK_INTERFACE					1
+#define LINK_EPIN_ADDR					0x82
+#define LINK_EPOUT_ADDR					0x02
+#define LINK_MAX_FS_PACKET				64
+
+extern USBD_ClassTypeDef USBD_LINK;
+#define USBD_LINK_CLASS					&USBD_LINK
+
+
+/* The callback is called from the USB IRQ once a whole request is received, no other one
+ * is received until its response is transmitted
+ */
+void USBD_LINK_RegisterRequestCallback(void (*cb)(void));
+uint8_t USBD_LINK_Transmit(USBD_HandleTypeDef *pdev, uint8_t *buf, uint16_t length);
+
+#endif /* _USBD_LINK_H_ */
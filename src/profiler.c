@@ -0,0 +1,202 @@
+/*
+ * MCUGotchi - A Tamagotchi P1 emulator for microcontrollers
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stdint.h>
+
+#include "ff_gen_drv.h"
+
+#include "storage.h"
+#include "profiler.h"
+
+#include "lib/tamalib.h"
+
+#ifdef PROFILER_ENABLED
+
+/* One bucket gathers 2^PC_SHIFT consecutive instructions to keep the histogram small */
+#define PC_SHIFT					3
+#define PC_NUM						((STORAGE_ROM_SIZE << 2)/sizeof(u12_t))
+#define BUCKET_NUM					(PC_NUM >> PC_SHIFT)
+
+/* The opcode class is given by its highest nibble */
+#define CLASS_NUM					16
+
+#define PROFILE_FILE_MAGIC				"TLPF"
+#define PROFILE_FILE_VERSION				1
+
+#define CHUNK_SIZE					32 // in bytes
+
+static const u12_t *g_program = NULL;
+static state_t *state = NULL;
+
+static uint16_t buckets[BUCKET_NUM];
+static uint32_t classes[CLASS_NUM];
+static uint32_t total_steps = 0;
+static uint8_t scale = 0;
+
+static uint8_t chunk[CHUNK_SIZE];
+
+
+void profiler_init(const u12_t *program)
+{
+	g_program = program;
+	state = tamalib_get_state();
+
+	profiler_reset();
+}
+
+void profiler_count(void)
+{
+	u13_t pc = *(state->pc);
+	uint16_t i;
+
+	if (pc >= PC_NUM) {
+		return;
+	}
+
+	classes[g_program[pc] >> 8]++;
+	total_steps++;
+
+	if (buckets[pc >> PC_SHIFT] == UINT16_MAX) {
+		/* Halve the whole histogram to keep the ratios between buckets */
+		for (i = 0; i < BUCKET_NUM; i++) {
+			buckets[i] >>= 1;
+		}
+
+		scale++;
+	}
+
+	buckets[pc >> PC_SHIFT]++;
+}
+
+void profiler_reset(void)
+{
+	uint16_t i;
+
+	for (i = 0; i < BUCKET_NUM; i++) {
+		buckets[i] = 0;
+	}
+
+	for (i = 0; i < CLASS_NUM; i++) {
+		classes[i] = 0;
+	}
+
+	total_steps = 0;
+	scale = 0;
+}
+
+static int8_t write_chunk(FIL *f, uint8_t *end)
+{
+	UINT num;
+
+	if (f_write(f, chunk, end - chunk, &num) || (num < end - chunk)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+int8_t profiler_dump(void)
+{
+	FIL f;
+	uint8_t *ptr = chunk;
+	uint16_t i;
+
+	if (f_open(&f, PROFILER_FILE_NAME, FA_CREATE_ALWAYS | FA_WRITE)) {
+		/* Error */
+		return -1;
+	}
+
+	/* First the magic, the version, the bucket size, the scale applied to the
+	 * buckets, the number of buckets and the total number of steps, then the
+	 * classes counters as u32 little-endian and finally the buckets counters
+	 * as u16 little-endian
+	 */
+	ptr[0] = (uint8_t) PROFILE_FILE_MAGIC[0];
+	ptr[1] = (uint8_t) PROFILE_FILE_MAGIC[1];
+	ptr[2] = (uint8_t) PROFILE_FILE_MAGIC[2];
+	ptr[3] = (uint8_t) PROFILE_FILE_MAGIC[3];
+	ptr += 4;
+
+	ptr[0] = PROFILE_FILE_VERSION & 0xFF;
+	ptr += 1;
+
+	ptr[0] = PC_SHIFT;
+	ptr += 1;
+
+	ptr[0] = scale;
+	ptr += 1;
+
+	ptr[0] = BUCKET_NUM & 0xFF;
+	ptr[1] = (BUCKET_NUM >> 8) & 0xFF;
+	ptr += 2;
+
+	ptr[0] = total_steps & 0xFF;
+	ptr[1] = (total_steps >> 8) & 0xFF;
+	ptr[2] = (total_steps >> 16) & 0xFF;
+	ptr[3] = (total_steps >> 24) & 0xFF;
+	ptr += 4;
+
+	if (write_chunk(&f, ptr) < 0) {
+		/* Error */
+		f_close(&f);
+		return -1;
+	}
+
+	ptr = chunk;
+
+	for (i = 0; i < CLASS_NUM; i++) {
+		ptr[0] = classes[i] & 0xFF;
+		ptr[1] = (classes[i] >> 8) & 0xFF;
+		ptr[2] = (classes[i] >> 16) & 0xFF;
+		ptr[3] = (classes[i] >> 24) & 0xFF;
+		ptr += 4;
+
+		if (ptr - chunk == CHUNK_SIZE || i == CLASS_NUM - 1) {
+			if (write_chunk(&f, ptr) < 0) {
+				/* Error */
+				f_close(&f);
+				return -1;
+			}
+
+			ptr = chunk;
+		}
+	}
+
+	for (i = 0; i < BUCKET_NUM; i++) {
+		ptr[0] = buckets[i] & 0xFF;
+		ptr[1] = (buckets[i] >> 8) & 0xFF;
+		ptr += 2;
+
+		if (ptr - chunk == CHUNK_SIZE || i == BUCKET_NUM - 1) {
+			if (write_chunk(&f, ptr) < 0) {
+				/* Error */
+				f_close(&f);
+				return -1;
+			}
+
+			ptr = chunk;
+		}
+	}
+
+	f_close(&f);
+
+	return 0;
+}
+
+#endif
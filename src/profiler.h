@@ -0,0 +1,44 @@
+/*
+ * MCUGotchi - A Tamagotchi P1 emulator for microcontrollers
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#include <stdint.h>
+
+#include "lib/tamalib.h"
+
+/* Define this to count the executed instructions per PC and per opcode class */
+//#define PROFILER_ENABLED
+
+#define PROFILER_FILE_NAME				"profile.bin"
+
+#ifdef PROFILER_ENABLED
+void profiler_init(const u12_t *program);
+void profiler_count(void);
+void profiler_reset(void);
+int8_t profiler_dump(void);
+#else
+#define profiler_init(program)
+#define profiler_count()
+#define profiler_reset()
+#define profiler_dump()					(-1)
+#endif
+
+#endif /* _PROFILER_H_ */
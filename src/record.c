@@ -0,0 +1,532 @@
+/*
+ * MCUGotchi - A Tamagotchi P1 emulator for microcontrollers
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+#include "eeprom.h"
+#include "record.h"
+
+#define RECORD_HEADER_SIZE				4 // length and checksum as u16 little-endian
+
+/* A log is split in two halves. Each one holds a base image followed by deltas, made of runs of
+ * changed bytes. When a half is full, a new base image is written to the other one. An invalidated
+ * log is a base without any image, it keeps the generation so that leftovers are never replayed.
+ */
+#define LOG_GENERATION_SIZE				2 // u16 little-endian, first field of each log entry
+#define LOG_RUN_HEADER_SIZE				3 // offset as u16 little-endian and length as u8
+#define LOG_RUN_MAX_GAP					LOG_RUN_HEADER_SIZE // Unchanged bytes cheaper to copy than to start a new run
+#define RECORD_WRITE_CHUNK_SIZE				16 // bytes written by each record_write_step(), four EEPROM words
+
+#if EEPROM_SIZE > 0
+#define LOG_IMAGE_MAX_SIZE				828
+#define LOG_DELTA_MAX_SIZE				256 // A new base image is written beyond that
+#else
+/* No data EEPROM, no need to waste RAM */
+#define LOG_IMAGE_MAX_SIZE				0
+#define LOG_DELTA_MAX_SIZE				0
+#endif
+
+typedef struct {
+	uint16_t offset;
+	uint16_t size; // header included, or size of each half for a log
+	uint8_t log;
+} record_desc_t;
+
+/* Only one record can be a log */
+static const record_desc_t records[RECORD_NUM] = {
+	[RECORD_CONFIG] = {0, 16, 0},
+	[RECORD_ROM] = {16, 16, 0},
+	[RECORD_AUTOSAVE] = {32, 3056, 1},
+};
+
+/* Last image written to the log, and where the next delta goes */
+static uint8_t log_image[LOG_IMAGE_MAX_SIZE];
+static uint8_t log_delta[LOG_DELTA_MAX_SIZE];
+static uint16_t log_length = 0; // 0 when the log has not been scanned yet
+static uint16_t log_generation = 0;
+static uint8_t log_half = 0;
+static uint8_t log_found = 0; // log_half holds the most recent base, possibly an empty one
+static uint16_t log_end = 0;
+
+/* Log entry written by chunks, write_data is NULL when there is none */
+static uint8_t *write_data = NULL; // image once written
+static uint8_t *write_payload;
+static uint16_t write_size;
+static uint16_t write_pos;
+static uint32_t write_offset;
+static uint8_t write_hdr[RECORD_HEADER_SIZE];
+static uint8_t write_generation[LOG_GENERATION_SIZE];
+static uint8_t write_base;
+static uint8_t write_half;
+
+
+static void update_checksum(uint16_t *sum1, uint16_t *sum2, uint8_t *data, uint16_t length)
+{
+	/* Fletcher-16 */
+	while (length-- > 0) {
+		*sum1 = (*sum1 + *(data++)) % 255;
+		*sum2 = (*sum2 + *sum1) % 255;
+	}
+}
+
+static int8_t read_entry(uint32_t offset, uint32_t max_size, uint16_t *length)
+{
+	uint8_t hdr[RECORD_HEADER_SIZE];
+	uint16_t sum1 = 0, sum2 = 0;
+	uint16_t i;
+	uint8_t byte;
+
+	if (max_size < RECORD_HEADER_SIZE || eeprom_read(offset, hdr, sizeof(hdr)) < 0) {
+		return -1;
+	}
+
+	*length = hdr[0] | (hdr[1] << 8);
+
+	/* An erased or invalidated entry has a null length */
+	if (*length == 0 || *length > max_size - RECORD_HEADER_SIZE) {
+		return -1;
+	}
+
+	for (i = 0; i < *length; i++) {
+		if (eeprom_read(offset + RECORD_HEADER_SIZE + i, &byte, 1) < 0) {
+			return -1;
+		}
+
+		update_checksum(&sum1, &sum2, &byte, 1);
+	}
+
+	if ((hdr[2] | (hdr[3] << 8)) != ((sum2 << 8) | sum1)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+static int8_t write_entry(uint32_t offset, uint8_t *prefix, uint16_t prefix_length, uint8_t *data, uint16_t length)
+{
+	uint8_t hdr[RECORD_HEADER_SIZE];
+	uint16_t sum1 = 0, sum2 = 0;
+
+	update_checksum(&sum1, &sum2, prefix, prefix_length);
+	update_checksum(&sum1, &sum2, data, length);
+
+	/* The header is written last, an interrupted write is caught by the checksum */
+	if (prefix_length > 0 && eeprom_write(offset + RECORD_HEADER_SIZE, prefix, prefix_length) < 0) {
+		return -1;
+	}
+
+	if (eeprom_write(offset + RECORD_HEADER_SIZE + prefix_length, data, length) < 0) {
+		return -1;
+	}
+
+	hdr[0] = (prefix_length + length) & 0xFF;
+	hdr[1] = ((prefix_length + length) >> 8) & 0xFF;
+	hdr[2] = sum1 & 0xFF;
+	hdr[3] = sum2 & 0xFF;
+
+	return eeprom_write(offset, hdr, sizeof(hdr));
+}
+
+static int8_t read_generation(uint32_t offset, uint16_t *generation)
+{
+	uint8_t buf[LOG_GENERATION_SIZE];
+
+	if (eeprom_read(offset + RECORD_HEADER_SIZE, buf, sizeof(buf)) < 0) {
+		return -1;
+	}
+
+	*generation = buf[0] | (buf[1] << 8);
+
+	return 0;
+}
+
+static int8_t apply_delta(uint32_t offset, uint16_t length)
+{
+	uint8_t hdr[LOG_RUN_HEADER_SIZE];
+	uint16_t run_offset;
+
+	while (length >= LOG_RUN_HEADER_SIZE) {
+		if (eeprom_read(offset, hdr, sizeof(hdr)) < 0) {
+			return -1;
+		}
+
+		run_offset = hdr[0] | (hdr[1] << 8);
+
+		if (hdr[2] == 0 || run_offset + hdr[2] > log_length || LOG_RUN_HEADER_SIZE + hdr[2] > length) {
+			return -1;
+		}
+
+		if (eeprom_read(offset + LOG_RUN_HEADER_SIZE, &log_image[run_offset], hdr[2]) < 0) {
+			return -1;
+		}
+
+		offset += LOG_RUN_HEADER_SIZE + hdr[2];
+		length -= LOG_RUN_HEADER_SIZE + hdr[2];
+	}
+
+	return (length == 0) ? 0 : -1;
+}
+
+static int8_t log_scan(const record_desc_t *desc)
+{
+	uint32_t base, pos;
+	uint16_t length, generation;
+	uint8_t h;
+
+	log_length = 0;
+	log_found = 0;
+
+	/* The most recent base image wins */
+	for (h = 0; h < 2; h++) {
+		base = desc->offset + h * desc->size;
+
+		if (read_entry(base, desc->size, &length) < 0 || length < LOG_GENERATION_SIZE ||
+			length - LOG_GENERATION_SIZE > LOG_IMAGE_MAX_SIZE || read_generation(base, &generation) < 0) {
+			continue;
+		}
+
+		if (!log_found || (int16_t) (generation - log_generation) > 0) {
+			log_found = 1;
+			log_half = h;
+			log_generation = generation;
+			log_end = RECORD_HEADER_SIZE + length;
+		}
+	}
+
+	if (!log_found || log_end == RECORD_HEADER_SIZE + LOG_GENERATION_SIZE) {
+		/* Nothing, or invalidated */
+		return -1;
+	}
+
+	base = desc->offset + log_half * desc->size;
+
+	if (eeprom_read(base + RECORD_HEADER_SIZE + LOG_GENERATION_SIZE, log_image, log_end - RECORD_HEADER_SIZE - LOG_GENERATION_SIZE) < 0) {
+		return -1;
+	}
+
+	log_length = log_end - RECORD_HEADER_SIZE - LOG_GENERATION_SIZE;
+
+	/* Then replay the deltas up to the first invalid one, those of an older generation are leftovers */
+	pos = base + log_end;
+
+	while (read_entry(pos, base + desc->size - pos, &length) == 0 && length > LOG_GENERATION_SIZE &&
+		read_generation(pos, &generation) == 0 && generation == log_generation &&
+		apply_delta(pos + RECORD_HEADER_SIZE + LOG_GENERATION_SIZE, length - LOG_GENERATION_SIZE) == 0) {
+		pos += RECORD_HEADER_SIZE + length;
+	}
+
+	log_end = pos - base;
+
+	return 0;
+}
+
+static int16_t build_delta(uint8_t *data)
+{
+	uint16_t i = 0, j, start, last, size = 0;
+
+	while (i < log_length) {
+		if (data[i] == log_image[i]) {
+			i++;
+			continue;
+		}
+
+		/* A run ends after a few unchanged bytes, or when its length does not fit anymore */
+		start = last = i;
+
+		while (i < log_length && i - start < 0xFF && i - last <= LOG_RUN_MAX_GAP) {
+			if (data[i] != log_image[i]) {
+				last = i;
+			}
+
+			i++;
+		}
+
+		if (size + LOG_RUN_HEADER_SIZE + (last - start + 1) > LOG_DELTA_MAX_SIZE) {
+			return -1;
+		}
+
+		log_delta[size++] = start & 0xFF;
+		log_delta[size++] = (start >> 8) & 0xFF;
+		log_delta[size++] = last - start + 1;
+
+		for (j = start; j <= last; j++) {
+			log_delta[size++] = data[j];
+		}
+
+		i = last + 1;
+	}
+
+	return size;
+}
+
+static void start_log_entry(uint32_t offset, uint16_t generation, uint8_t *payload, uint16_t size, uint8_t *data)
+{
+	uint16_t sum1 = 0, sum2 = 0;
+
+	write_generation[0] = generation & 0xFF;
+	write_generation[1] = (generation >> 8) & 0xFF;
+
+	update_checksum(&sum1, &sum2, write_generation, sizeof(write_generation));
+	update_checksum(&sum1, &sum2, payload, size);
+
+	write_hdr[0] = (LOG_GENERATION_SIZE + size) & 0xFF;
+	write_hdr[1] = ((LOG_GENERATION_SIZE + size) >> 8) & 0xFF;
+	write_hdr[2] = sum1 & 0xFF;
+	write_hdr[3] = sum2 & 0xFF;
+
+	write_offset = offset;
+	write_payload = payload;
+	write_size = size;
+	write_pos = 0;
+	write_data = data;
+}
+
+static void end_log_entry(void)
+{
+	uint16_t i;
+
+	if (write_base) {
+		log_found = 1;
+		log_half = write_half;
+		log_generation = write_generation[0] | (write_generation[1] << 8);
+		log_length = write_size;
+		log_end = RECORD_HEADER_SIZE + LOG_GENERATION_SIZE + write_size;
+	} else {
+		log_end += RECORD_HEADER_SIZE + LOG_GENERATION_SIZE + write_size;
+	}
+
+	for (i = 0; i < log_length; i++) {
+		log_image[i] = write_data[i];
+	}
+
+	write_data = NULL;
+}
+
+static int8_t log_write_start(const record_desc_t *desc, uint8_t *data, uint16_t length)
+{
+	int16_t size;
+
+	if (length > LOG_IMAGE_MAX_SIZE || RECORD_HEADER_SIZE + LOG_GENERATION_SIZE + length > desc->size) {
+		return -1;
+	}
+
+	if (log_length != length) {
+		log_scan(desc);
+	}
+
+	if (log_length == length) {
+		size = build_delta(data);
+
+		if (size == 0) {
+			/* Nothing changed */
+			return 0;
+		}
+
+		if (size > 0 && log_end + RECORD_HEADER_SIZE + LOG_GENERATION_SIZE + size <= desc->size) {
+			write_base = 0;
+			start_log_entry(desc->offset + log_half * desc->size + log_end, log_generation, log_delta, size, data);
+			return 0;
+		}
+	}
+
+	/* Compaction: a new base image goes to the other half, the current one stays valid meanwhile,
+	 * even if it is an empty one
+	 */
+	write_base = 1;
+	write_half = log_found ? !log_half : 0;
+	start_log_entry(desc->offset + write_half * desc->size, log_generation + 1, data, length, data);
+
+	return 0;
+}
+
+static void finish_write(void)
+{
+	while (record_write_step() > 0);
+}
+
+int8_t record_write_start(record_id_t id, uint8_t *data, uint16_t length)
+{
+	if (id >= RECORD_NUM || length == 0) {
+		return -1;
+	}
+
+	/* Only one write at a time */
+	finish_write();
+
+	if (records[id].log) {
+		return log_write_start(&records[id], data, length);
+	}
+
+	if (RECORD_HEADER_SIZE + length > records[id].size) {
+		return -1;
+	}
+
+	/* Small enough to be written at once */
+	return write_entry(records[id].offset, NULL, 0, data, length);
+}
+
+int8_t record_write_step(void)
+{
+	uint32_t addr = write_offset + RECORD_HEADER_SIZE + LOG_GENERATION_SIZE + write_pos;
+	uint16_t len = write_size - write_pos;
+	int8_t ret;
+
+	if (write_data == NULL) {
+		/* Nothing to do */
+		return 0;
+	}
+
+	if (len > 0) {
+		if (len > RECORD_WRITE_CHUNK_SIZE) {
+			len = RECORD_WRITE_CHUNK_SIZE;
+		}
+
+		/* The generation goes with the first chunk */
+		ret = (write_pos == 0) ? eeprom_write(write_offset + RECORD_HEADER_SIZE, write_generation, sizeof(write_generation)) : 0;
+
+		if (ret == 0) {
+			ret = eeprom_write(addr, &write_payload[write_pos], len);
+		}
+
+		write_pos += len;
+	} else {
+		/* The header is written last, an interrupted write is caught by the checksum */
+		ret = eeprom_write(write_offset, write_hdr, sizeof(write_hdr));
+
+		if (ret == 0) {
+			end_log_entry();
+			return 0;
+		}
+	}
+
+	if (ret < 0) {
+		/* The log has to be scanned again */
+		write_data = NULL;
+		log_length = 0;
+		return -1;
+	}
+
+	return 1;
+}
+
+int8_t record_write(record_id_t id, uint8_t *data, uint16_t length)
+{
+	int8_t ret;
+
+	if (record_write_start(id, data, length) < 0) {
+		return -1;
+	}
+
+	while ((ret = record_write_step()) > 0);
+
+	return ret;
+}
+
+int8_t record_read(record_id_t id, uint8_t *data, uint16_t length)
+{
+	uint16_t stored_length;
+	uint16_t i;
+
+	if (id >= RECORD_NUM) {
+		return -1;
+	}
+
+	if (records[id].log) {
+		finish_write();
+
+		/* Base image plus deltas */
+		if ((log_length == 0 && log_scan(&records[id]) < 0) || log_length != length) {
+			return -1;
+		}
+
+		for (i = 0; i < length; i++) {
+			data[i] = log_image[i];
+		}
+
+		return 0;
+	}
+
+	if (read_entry(records[id].offset, records[id].size, &stored_length) < 0 || stored_length != length) {
+		return -1;
+	}
+
+	return eeprom_read(records[id].offset + RECORD_HEADER_SIZE, data, length);
+}
+
+uint8_t record_stat(record_id_t id)
+{
+	uint16_t length;
+
+	if (id >= RECORD_NUM) {
+		return 0;
+	}
+
+	if (records[id].log) {
+		finish_write();
+
+		return (log_length != 0 || log_scan(&records[id]) == 0);
+	}
+
+	return (read_entry(records[id].offset, records[id].size, &length) == 0);
+}
+
+void record_invalidate(record_id_t id)
+{
+	uint8_t hdr[RECORD_HEADER_SIZE] = {0};
+	uint8_t generation[LOG_GENERATION_SIZE];
+
+	if (id >= RECORD_NUM) {
+		return;
+	}
+
+	if (!records[id].log) {
+		eeprom_write(records[id].offset, hdr, sizeof(hdr));
+		return;
+	}
+
+	finish_write();
+
+	if (log_length == 0) {
+		log_scan(&records[id]);
+	}
+
+	if (!log_found) {
+		/* Nothing to invalidate */
+		return;
+	}
+
+	/* A newer empty base goes to the other half, erasing the headers would restart the
+	 * generations and let older deltas match a new base. The most recent base stays
+	 * valid until the empty one is complete.
+	 */
+	generation[0] = (log_generation + 1) & 0xFF;
+	generation[1] = ((log_generation + 1) >> 8) & 0xFF;
+
+	if (write_entry(records[id].offset + !log_half * records[id].size, generation, sizeof(generation), NULL, 0) < 0) {
+		/* The log has to be scanned again */
+		log_length = 0;
+		log_found = 0;
+		return;
+	}
+
+	log_generation++;
+	log_half = !log_half;
+	log_length = 0;
+}
@@ -0,0 +1,49 @@
+/*
+ * MCUGotchi - A Tamagotchi P1 emulator for microcontrollers
+ *
+ * Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stdint.h>
+
+/* Small records kept in the data EEPROM when there is one, they are much
+ * cheaper to update than files
+ */
+typedef enum {
+	RECORD_CONFIG = 0,
+	RECORD_ROM,
+	RECORD_AUTOSAVE,
+
+	RECORD_NUM,
+} record_id_t;
+
+
+int8_t record_write(record_id_t id, uint8_t *data, uint16_t length);
+
+/* Same as record_write(), but a log record is written by chunks by calling record_write_step()
+ * until it does not return 1 anymore. The data must stay untouched meanwhile, any other
+ * access to the log finishes the write first.
+ */
+int8_t record_write_start(record_id_t id, uint8_t *data, uint16_t length);
+int8_t record_write_step(void);
+int8_t record_read(record_id_t id, uint8_t *data, uint16_t length);
+uint8_t record_stat(record_id_t id);
+void record_invalidate(record_id_t id);
+
+#endif /* _RECORD_H_ */
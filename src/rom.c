@@ -22,6 +22,9 @@
 #include "ff_gen_drv.h"
 
 #include "storage.h"
+#include "time.h"
+#include "record.h"
+#include "fs_ll.h"
 #include "rom.h"
 
 #include "lib/tamalib.h"
@@ -39,68 +42,723 @@ static __attribute__((used, section(".rom"))) const u12_t g_program[];
 
 #define RESET_VECTOR_ADDR_U12				0x100
 #define RESET_VECTOR_ADDR_U8				(RESET_VECTOR_ADDR_U12 * sizeof(u12_t))
+#define RESET_VECTOR_WORD				(RESET_VECTOR_ADDR_U8 >> 2)
+
+/* Slot, file size and hash of the file content (u32 little-endian) of a ROM file */
+#define FINGERPRINT_SIZE				9
+
+/* FNV-1a */
+#define FILE_HASH_INIT					2166136261UL
+#define FILE_HASH_PRIME					16777619UL
+
+/* The record holds the fingerprint of the ROM installed in the ROM area, followed by the slot in use */
+#define ROM_RECORD_SIZE					(FINGERPRINT_SIZE + 1)
+#define NO_SLOT						0xFF
+
+/* Steps converted at once, the page buffer is used by the file system writes */
+#define CONVERT_CHUNK_SIZE_U12				32
+
+#define ROM_AREA					((const u12_t *) (STORAGE_BASE_ADDRESS + (STORAGE_ROM_OFFSET << 2)))
+
+typedef struct {
+	const u12_t *program; // NULL if the ROM is not resident
+	uint32_t size; // in u12_t
+	uint32_t hash;
+	uint8_t fingerprint[FINGERPRINT_SIZE];
+} rom_bank_t;
 
 static char rom_file_name[] = "romX.bin";
+static char rom_tmp_name[] = "romX.tmp";
 
+/* The ROMs that can be selected without programming the flash, either executed in place
+ * or already installed in the ROM area
+ */
+static rom_bank_t banks[ROM_SLOTS_NUM];
+static uint8_t area_fingerprint[FINGERPRINT_SIZE] = {NO_SLOT};
 
-int8_t rom_load(uint8_t slot)
+/* One bit per slot with a file, updated each time the slots are scanned */
+static uint8_t slots_used = 0;
+
+static const u12_t *program = ROM_AREA;
+static uint8_t current_slot = NO_SLOT;
+
+/* Next offset of a ROM programmed by chunks, in words */
+static uint32_t stream_offset = 0;
+static uint8_t stream_open = 0;
+
+/* Programmed last, so that an unfinished ROM is never seen as loaded */
+static uint32_t stream_reset_word;
+
+static uint32_t load_time = 0;
+
+
+static uint8_t is_jump(u12_t op)
+{
+	/* Regular JP instruction */
+	return (((op & 0xF00) == 0x000) && ((op & 0x0FF) != 0x000));
+}
+
+static uint32_t get_hash(const u12_t *data, uint32_t size)
+{
+	uint32_t hash = 0;
+
+	/* Rotate and xor, cheap enough to be checked on every switch */
+	while (size-- > 0) {
+		hash = ((hash << 5) | (hash >> 27)) ^ *(data++);
+	}
+
+	return hash;
+}
+
+static uint32_t update_file_hash(uint32_t hash, const uint8_t *data, uint32_t size)
+{
+	while (size-- > 0) {
+		hash = (hash ^ *(data++)) * FILE_HASH_PRIME;
+	}
+
+	return hash;
+}
+
+static void make_fingerprint(uint8_t *fingerprint, uint8_t slot, uint32_t size, uint32_t hash)
+{
+	fingerprint[0] = slot;
+	fingerprint[1] = size & 0xFF;
+	fingerprint[2] = (size >> 8) & 0xFF;
+	fingerprint[3] = (size >> 16) & 0xFF;
+	fingerprint[4] = (size >> 24) & 0xFF;
+	fingerprint[5] = hash & 0xFF;
+	fingerprint[6] = (hash >> 8) & 0xFF;
+	fingerprint[7] = (hash >> 16) & 0xFF;
+	fingerprint[8] = (hash >> 24) & 0xFF;
+}
+
+static void copy_fingerprint(uint8_t *dst, uint8_t *src)
+{
+	uint8_t i;
+
+	for (i = 0; i < FINGERPRINT_SIZE; i++) {
+		dst[i] = src[i];
+	}
+}
+
+static uint8_t is_same_fingerprint(uint8_t *a, uint8_t *b)
+{
+	uint8_t i;
+
+	for (i = 0; i < FINGERPRINT_SIZE; i++) {
+		if (a[i] != b[i]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static uint32_t get_fingerprint_size(uint8_t *fingerprint)
+{
+	return fingerprint[1] | (fingerprint[2] << 8) | (fingerprint[3] << 16) | ((uint32_t) fingerprint[4] << 24);
+}
+
+static int8_t stat_slot(uint8_t slot)
+{
+	FILINFO info;
+
+	rom_file_name[3] = slot + '0';
+
+	if (f_stat(rom_file_name, &info)) {
+		/* Error */
+		return -1;
+	}
+
+	return 0;
+}
+
+static int8_t open_slot(uint8_t slot, FIL *f)
+{
+	rom_file_name[3] = slot + '0';
+
+	if (f_open(f, rom_file_name, FA_OPEN_EXISTING | FA_READ)) {
+		/* Error */
+		return -1;
+	}
+
+	return 0;
+}
+
+static void save_record(void)
+{
+	uint8_t rec[ROM_RECORD_SIZE];
+
+	copy_fingerprint(rec, area_fingerprint);
+	rec[FINGERPRINT_SIZE] = current_slot;
+
+	/* Fails if there is no data EEPROM */
+	record_write(RECORD_ROM, rec, sizeof(rec));
+}
+
+static void set_bank(uint8_t slot, const u12_t *prog, uint32_t size, uint8_t *fingerprint)
+{
+	banks[slot].program = prog;
+	banks[slot].size = size;
+	banks[slot].hash = get_hash(prog, size);
+	copy_fingerprint(banks[slot].fingerprint, fingerprint);
+}
+
+static uint8_t is_bank_valid(uint8_t slot)
+{
+	rom_bank_t *bank = &banks[slot];
+
+	if (bank->program == NULL || bank->size <= RESET_VECTOR_ADDR_U12 || !is_jump(bank->program[RESET_VECTOR_ADDR_U12])) {
+		return 0;
+	}
+
+	/* The flash might have been reused since the bank was registered */
+	return (get_hash(bank->program, bank->size) == bank->hash);
+}
+
+static uint32_t get_first_sector(FIL *f)
+{
+	DWORD clmt[4];
+
+	/* Fails if the file is made of more than one fragment */
+	clmt[0] = sizeof(clmt)/sizeof(DWORD);
+	f->cltbl = clmt;
+
+	if (f_lseek(f, CREATE_LINKMAP) != FR_OK || clmt[1] == 0) {
+		f->cltbl = NULL;
+		return 0;
+	}
+
+	f->cltbl = NULL;
+
+	return f->obj.fs->database + (clmt[2] - 2) * f->obj.fs->csize;
+}
+
+static int8_t hash_file(FIL *f, uint32_t size, uint32_t *hash)
+{
+	uint32_t sector;
+	const uint8_t *data;
+	uint8_t *buf;
+	UINT num;
+
+	*hash = FILE_HASH_INIT;
+
+	/* A contiguous file already in flash is hashed without going through FatFs */
+	sector = get_first_sector(f);
+	if (sector != 0 && size > 0) {
+		data = (const uint8_t *) fs_ll_get_read_address(sector, (size + _MAX_SS - 1)/_MAX_SS);
+		if (data != NULL) {
+			*hash = update_file_hash(*hash, data, size);
+			return 0;
+		}
+	}
+
+	buf = (uint8_t *) storage_get_page_buffer();
+
+	while (size > 0) {
+		num = (size > (STORAGE_PAGE_SIZE << 2)) ? (STORAGE_PAGE_SIZE << 2) : size;
+
+		if (f_read(f, buf, num, &num) || num == 0) {
+			/* Error */
+			break;
+		}
+
+		*hash = update_file_hash(*hash, buf, num);
+		size -= num;
+	}
+
+	/* The file is read again from the start if it has to be installed */
+	if (f_lseek(f, 0) || size > 0) {
+		/* Error */
+		return -1;
+	}
+
+	return 0;
+}
+
+static uint8_t is_area_file(uint8_t slot, FIL *f)
+{
+	uint8_t fingerprint[FINGERPRINT_SIZE];
+	uint32_t hash;
+
+	/* Only the file of the slot the ROM area was installed from is worth hashing */
+	if (area_fingerprint[0] != slot || get_fingerprint_size(area_fingerprint) != f_size(f) || !rom_is_loaded()) {
+		return 0;
+	}
+
+	if (hash_file(f, (f_size(f)/2) * 2, &hash) < 0) {
+		return 0;
+	}
+
+	make_fingerprint(fingerprint, slot, f_size(f), hash);
+
+	return is_same_fingerprint(fingerprint, area_fingerprint);
+}
+
+static const u12_t * map_file(FIL *f)
+{
+	uint32_t sector;
+	const u12_t *data;
+	uint32_t i;
+
+	sector = get_first_sector(f);
+	if (sector == 0) {
+		return NULL;
+	}
+
+	/* The file data must be in flash, at a fixed location */
+	if (fs_ll_sync() < 0) {
+		return NULL;
+	}
+
+	data = (const u12_t *) fs_ll_get_sector_address(sector);
+	if (data == NULL || fs_ll_get_sector_address(sector + (f_size(f) - 1)/_MAX_SS) == NULL) {
+		return NULL;
+	}
+
+	/* Only native files can be executed, the upper nibble of each instruction is then
+	 * cleared, which is not the case of the big-endian dumps of the real ROM
+	 */
+	for (i = 0; i < f_size(f)/sizeof(u12_t); i++) {
+		if (data[i] & 0xF000) {
+			return NULL;
+		}
+	}
+
+	if (f_size(f) <= RESET_VECTOR_ADDR_U8 || !is_jump(data[RESET_VECTOR_ADDR_U12])) {
+		return NULL;
+	}
+
+	return data;
+}
+
+static int8_t map_slot(uint8_t slot)
 {
 	FIL f;
+	uint8_t fingerprint[FINGERPRINT_SIZE];
+	const u12_t *mapped;
+
+	if (open_slot(slot, &f) < 0) {
+		return -1;
+	}
+
+	/* A contiguous native file is executed in place, nothing needs to be programmed */
+	mapped = map_file(&f);
+	if (mapped != NULL) {
+		make_fingerprint(fingerprint, slot, f_size(&f), update_file_hash(FILE_HASH_INIT, (const uint8_t *) mapped, (f_size(&f)/2) * 2));
+		set_bank(slot, mapped, f_size(&f)/sizeof(u12_t), fingerprint);
+	}
+
+	f_close(&f);
+
+	return (mapped != NULL) ? 0 : -1;
+}
+
+static int8_t convert_slot(uint8_t slot)
+{
+	FIL src, dst;
 	UINT num;
 	uint32_t size;
-	uint32_t i = 0;
-	uint8_t buf[2];
-	u12_t steps[PAGE_SIZE_U12];
+	uint32_t offset = 0;
+	uint32_t i, len;
+	u12_t steps[CONVERT_CHUNK_SIZE_U12];
+	uint8_t *buf = (uint8_t *) steps;
+	uint8_t native = 1;
+	FRESULT res = FR_OK;
 
-	if (slot >= ROM_SLOTS_NUM) {
+	/* Sectors without a fixed location cannot be executed in place */
+	if (fs_ll_get_sector_address(0) == NULL) {
+		return -1;
+	}
+
+	if (open_slot(slot, &src) < 0) {
 		return -1;
 	}
 
+	size = f_size(&src)/2;
+
+	/* A native file only needs to be copied as a single fragment */
+	while (res == FR_OK && offset < size) {
+		len = size - offset;
+		if (len > CONVERT_CHUNK_SIZE_U12) {
+			len = CONVERT_CHUNK_SIZE_U12;
+		}
+
+		if (f_read(&src, buf, len * 2, &num) || (num < len * 2)) {
+			res = FR_DISK_ERR;
+			break;
+		}
+
+		for (i = 0; i < len; i++) {
+			if ((buf[2 * i] | (buf[2 * i + 1] << 8)) & 0xF000) {
+				native = 0;
+			}
+		}
+
+		offset += len;
+	}
+
+	rom_tmp_name[3] = slot + '0';
+
+	if (res != FR_OK || f_lseek(&src, 0) || f_open(&dst, rom_tmp_name, FA_CREATE_ALWAYS | FA_WRITE)) {
+		/* Error */
+		f_close(&src);
+		return -1;
+	}
+
+	/* Searched from the start of the volume, a block found across its end when the search
+	 * wraps around would not be contiguous
+	 */
+	dst.obj.fs->last_clst = 0;
+
+	res = f_expand(&dst, size * 2, 1);
+	offset = 0;
+
+	while (res == FR_OK && offset < size) {
+		len = size - offset;
+		if (len > CONVERT_CHUNK_SIZE_U12) {
+			len = CONVERT_CHUNK_SIZE_U12;
+		}
+
+		if (f_read(&src, buf, len * 2, &num) || (num < len * 2)) {
+			res = FR_DISK_ERR;
+			break;
+		}
+
+		/* Big-endian to native, in place */
+		for (i = 0; i < len && !native; i++) {
+			steps[i] = buf[2 * i + 1] | ((buf[2 * i] & 0xF) << 8);
+		}
+
+		if (f_write(&dst, buf, len * 2, &num) || (num < len * 2)) {
+			res = FR_DISK_ERR;
+			break;
+		}
+
+		offset += len;
+	}
+
+	f_close(&src);
+
+	if (f_close(&dst) || res != FR_OK) {
+		/* Error, not enough contiguous space is the most likely one */
+		f_unlink(rom_tmp_name);
+		return -1;
+	}
+
+	/* The original file is only removed once the native one is complete,
+	 * scan_banks() finishes the job if it is interrupted
+	 */
 	rom_file_name[3] = slot + '0';
 
-	if (f_open(&f, rom_file_name, FA_OPEN_EXISTING | FA_READ)) {
+	if (f_unlink(rom_file_name) || f_rename(rom_tmp_name, rom_file_name)) {
 		/* Error */
 		return -1;
 	}
 
-	size = f_size(&f)/2;
+	return 0;
+}
 
-	while (i < size) {
-		if (f_read(&f, buf, 2, &num) || (num < 2)) {
-			/* Error */
-			f_close(&f);
-			return -1;
+static void drop_area(void)
+{
+	uint8_t i;
+
+	area_fingerprint[0] = NO_SLOT;
+	save_record();
+
+	for (i = 0; i < ROM_SLOTS_NUM; i++) {
+		if (banks[i].program == ROM_AREA) {
+			banks[i].program = NULL;
 		}
+	}
+}
 
-		steps[i % PAGE_SIZE_U12] = buf[1] | ((buf[0] & 0xF) << 8);
+static int8_t install_slot(uint8_t slot)
+{
+	FIL f;
+	UINT num;
+	uint32_t size;
+	uint32_t offset = 0;
+	uint32_t i, len;
+	uint32_t hash = FILE_HASH_INIT;
+	uint8_t *buf;
+	u12_t *steps;
 
-		i++;
+	if (open_slot(slot, &f) < 0) {
+		return -1;
+	}
+
+	size = f_size(&f)/2;
+
+	/* Nothing to do if this very file is already installed */
+	if (!is_area_file(slot, &f)) {
+		/* The installed ROM is about to change */
+		drop_area();
 
-		if ((i % PAGE_SIZE_U12) == 0 || i == size) {
-			/* Flash the page */
-			if (storage_write(STORAGE_ROM_OFFSET + ((i - 1)/PAGE_SIZE_U12) * STORAGE_PAGE_SIZE, (uint32_t *) steps, ((((i - 1) % PAGE_SIZE_U12) + 1) * sizeof(u12_t) + sizeof(uint32_t) - 1)/sizeof(uint32_t)) < 0) {
+		buf = (uint8_t *) storage_get_page_buffer();
+		steps = (u12_t *) buf;
+
+		while (offset < size) {
+			/* A page worth of steps is read at once, straight into the page buffer */
+			len = size - offset;
+			if (len > PAGE_SIZE_U12) {
+				len = PAGE_SIZE_U12;
+			}
+
+			if (f_read(&f, buf, len * 2, &num) || (num < len * 2)) {
 				/* Error */
 				f_close(&f);
 				return -1;
 			}
+
+			/* The file content is hashed as it is read, to recognize it next time */
+			hash = update_file_hash(hash, buf, len * 2);
+
+			/* Big-endian to native, in place */
+			for (i = 0; i < len; i++) {
+				steps[i] = buf[2 * i + 1] | ((buf[2 * i] & 0xF) << 8);
+			}
+
+			/* Flash the page, unchanged pages are skipped */
+			if (storage_write(STORAGE_ROM_OFFSET + (offset/PAGE_SIZE_U12) * STORAGE_PAGE_SIZE, (uint32_t *) steps, (len * sizeof(u12_t) + sizeof(uint32_t) - 1)/sizeof(uint32_t)) < 0) {
+				/* Error */
+				f_close(&f);
+				return -1;
+			}
+
+			offset += len;
 		}
+
+		make_fingerprint(area_fingerprint, slot, f_size(&f), hash);
 	}
 
 	f_close(&f);
 
+	set_bank(slot, ROM_AREA, size, area_fingerprint);
+
 	return 0;
 }
 
+static void scan_banks(void)
+{
+	FIL f;
+	uint8_t slot;
+
+	slots_used = 0;
+
+	for (slot = 0; slot < ROM_SLOTS_NUM; slot++) {
+		banks[slot].program = NULL;
+
+		/* A converted file left complete, or a stale one */
+		rom_tmp_name[3] = slot + '0';
+
+		if (stat_slot(slot) < 0) {
+			if (f_rename(rom_tmp_name, rom_file_name) || stat_slot(slot) < 0) {
+				/* Empty slot */
+				continue;
+			}
+		} else {
+			f_unlink(rom_tmp_name);
+		}
+
+		slots_used |= (1 << slot);
+
+		if (map_slot(slot) == 0 || open_slot(slot, &f) < 0) {
+			continue;
+		}
+
+		/* The ROM area still holds this very file */
+		if (is_area_file(slot, &f)) {
+			set_bank(slot, ROM_AREA, f_size(&f)/2, area_fingerprint);
+		}
+
+		f_close(&f);
+	}
+}
+
+int8_t rom_load(uint8_t slot)
+{
+	mcu_time_t start = time_get();
+
+	if (slot >= ROM_SLOTS_NUM) {
+		return -1;
+	}
+
+	/* A resident ROM only needs to be selected. Any other file is turned into a contiguous native one
+	 * to be executed in place, the ROM area is only programmed if that is not possible.
+	 */
+	if (!is_bank_valid(slot) && map_slot(slot) < 0) {
+		if (convert_slot(slot) == 0) {
+			if (map_slot(slot) < 0) {
+				return -1;
+			}
+		} else if (install_slot(slot) < 0) {
+			return -1;
+		}
+	}
+
+	program = banks[slot].program;
+	current_slot = slot;
+	save_record();
+
+	load_time = ((uint64_t) (time_get() - start) * 1000000ULL)/MCU_TIME_FREQ_X1000;
+
+	return 0;
+}
+
+int8_t rom_init(void)
+{
+	uint8_t rec[ROM_RECORD_SIZE];
+	uint8_t slot = NO_SLOT;
+
+	if (record_read(RECORD_ROM, rec, sizeof(rec)) == 0) {
+		copy_fingerprint(area_fingerprint, rec);
+		slot = rec[FINGERPRINT_SIZE];
+	}
+
+	scan_banks();
+
+	/* The ROM used before the reset */
+	if (slot < ROM_SLOTS_NUM && rom_load(slot) == 0) {
+		return 0;
+	}
+
+	if (rom_is_loaded()) {
+		program = ROM_AREA;
+		return 0;
+	}
+
+	return rom_load(DEFAULT_ROM_SLOT);
+}
+
+int8_t rom_refresh(void)
+{
+	rom_bank_t old_bank = {0};
+	uint8_t slot = current_slot;
+	uint8_t area_broken = 0;
+
+	if (slot < ROM_SLOTS_NUM) {
+		old_bank = banks[slot];
+	}
+
+	/* A ROM transfer left unfinished, the ROM area is partly written */
+	if (stream_open) {
+		stream_open = 0;
+		area_broken = 1;
+	}
+
+	/* The host might have changed, moved or removed any file */
+	scan_banks();
+
+	/* The ROM area cannot be changed from the host, the installed ROM keeps running,
+	 * unless its file has been replaced or it has to be installed again from its slot
+	 */
+	if (program == ROM_AREA && !area_broken && (slot >= ROM_SLOTS_NUM || !rom_stat(slot) || banks[slot].program == ROM_AREA)) {
+		return 0;
+	}
+
+	if (rom_load(slot) < 0) {
+		return -1;
+	}
+
+	if (program != old_bank.program || banks[slot].hash != old_bank.hash || !is_same_fingerprint(banks[slot].fingerprint, old_bank.fingerprint)) {
+		return 1;
+	}
+
+	return 0;
+}
+
+const u12_t * rom_get_program(void)
+{
+	return program;
+}
+
+void rom_stream_start(void)
+{
+	drop_area();
+	stream_offset = 0;
+	stream_open = 1;
+}
+
+int8_t rom_stream_write(uint8_t *data, uint16_t length)
+{
+	u12_t *steps = (u12_t *) data;
+	uint32_t *words = (uint32_t *) data;
+	uint16_t i;
+
+	if (!stream_open || (length & 0x3) || stream_offset + (length >> 2) > STORAGE_ROM_SIZE) {
+		return -1;
+	}
+
+	/* Big-endian to native, in place */
+	for (i = 0; i < length/2; i++) {
+		steps[i] = data[2 * i + 1] | ((data[2 * i] & 0xF) << 8);
+	}
+
+	/* The reset vector is left erased until rom_stream_end() */
+	if (stream_offset <= RESET_VECTOR_WORD && RESET_VECTOR_WORD < stream_offset + (length >> 2)) {
+		stream_reset_word = words[RESET_VECTOR_WORD - stream_offset];
+		words[RESET_VECTOR_WORD - stream_offset] = STORAGE_ERASED_WORD;
+	}
+
+	if (storage_write(STORAGE_ROM_OFFSET + stream_offset, (uint32_t *) data, length >> 2) < 0) {
+		return -1;
+	}
+
+	stream_offset += length >> 2;
+
+	return 0;
+}
+
+int8_t rom_stream_end(void)
+{
+	if (!stream_open || stream_offset <= RESET_VECTOR_WORD) {
+		return -1;
+	}
+
+	if (storage_program(STORAGE_ROM_OFFSET + RESET_VECTOR_WORD, &stream_reset_word, 1) < 0 || !rom_is_loaded()) {
+		return -1;
+	}
+
+	stream_open = 0;
+
+	/* The ROM does not come from any slot */
+	program = ROM_AREA;
+	current_slot = NO_SLOT;
+	save_record();
+
+	return 0;
+}
+
+uint8_t rom_is_in_place(void)
+{
+	return (program != ROM_AREA);
+}
+
+uint32_t rom_get_load_time(void)
+{
+	return load_time;
+}
+
 uint8_t rom_stat(uint8_t slot)
 {
 	if (slot >= ROM_SLOTS_NUM) {
 		return 0;
 	}
 
-	rom_file_name[3] = slot + '0';
+	/* Check if the slot exists, as of the last scan */
+	return ((slots_used >> slot) & 0x1);
+}
+
+int8_t rom_get_hash(uint8_t slot, uint32_t *hash)
+{
+	if (slot >= ROM_SLOTS_NUM || banks[slot].program == NULL) {
+		return -1;
+	}
 
-	/* Check if the slot exists */
-	return (f_stat(rom_file_name, NULL) == FR_OK);
+	*hash = banks[slot].hash;
+
+	return 0;
 }
 
 uint8_t rom_is_loaded(void)
@@ -116,5 +774,5 @@ uint8_t rom_is_loaded(void)
 	reset_vector = (u12_t *) &(buf[RESET_VECTOR_ADDR_U8 & 0x3]);
 
 	/* Check that the reset vector is a regular JP instruction */
-	return (((*reset_vector & 0xF00) == 0x000) && ((*reset_vector & 0x0FF) != 0x000));
+	return is_jump(*reset_vector);
 }
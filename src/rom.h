@@ -22,12 +22,53 @@
 
 #include <stdint.h>
 
+#include "lib/tamalib.h"
+
 #define ROM_SLOTS_NUM					4
 #define DEFAULT_ROM_SLOT				0
 
 
+/* Loads the ROM used before the reset, or the default one */
+int8_t rom_init(void);
+
+/* A contiguous ROM file in native format (u12_t little-endian) is executed in place.
+ * Any other ROM file is first rewritten as such, the ROM is only programmed to the ROM
+ * storage area if there is not enough contiguous space left or if the sectors of the
+ * file system have no fixed location. Switching to a ROM that is
+ * already resident in flash does not program anything.
+ */
 int8_t rom_load(uint8_t slot);
 uint8_t rom_stat(uint8_t slot);
+
+/* Hash of the instructions of a slot, as of the last scan or load. Fails if its ROM is not
+ * resident in flash, i.e. neither executed in place nor installed in the ROM storage area.
+ */
+int8_t rom_get_hash(uint8_t slot, uint32_t *hash);
 uint8_t rom_is_loaded(void);
 
+/* Scans the slots again and loads again a ROM executed in place, or a ROM whose file
+ * content no longer matches the installed one, since they might have been changed from
+ * the USB host. Returns 1 if the program changed.
+ */
+int8_t rom_refresh(void);
+
+/* The program to give to TamaLIB */
+const u12_t * rom_get_program(void);
+
+/* Programs a ROM to the ROM storage area by chunks of big-endian dump data, each of them
+ * being a multiple of 4 bytes and word aligned. The ROM in use is only changed once
+ * rom_stream_end() succeeds, but it must not be executed meanwhile if it comes from
+ * the ROM storage area. If the stream is left unfinished, rom_refresh() installs the
+ * ROM in use again, or fails if it does not come from any slot.
+ */
+void rom_stream_start(void);
+int8_t rom_stream_write(uint8_t *data, uint16_t length);
+int8_t rom_stream_end(void);
+
+/* Returns 1 if the program is executed from the file system */
+uint8_t rom_is_in_place(void);
+
+/* Duration of the last successful rom_load() in ms */
+uint32_t rom_get_load_time(void);
+
 #endif /* _ROM_H_ */
@@ -25,6 +25,10 @@
 #include "board.h"
 #include "ssd1306.h"
 
+/* End of the power-up delay */
+static mcu_time_t ready_time;
+
+
 void ssd1306_init(void)
 {
 	spi_init();
@@ -41,7 +45,13 @@ void ssd1306_init(void)
 	gpio_set(BOARD_SCREEN_RST_PORT, BOARD_SCREEN_RST_PIN);
 	gpio_set(BOARD_SCREEN_DC_PORT, BOARD_SCREEN_DC_PIN);
 	gpio_set(BOARD_SCREEN_NSS_PORT, BOARD_SCREEN_NSS_PIN);
-	time_delay(MS_TO_MCU_TIME(10));
+
+	ready_time = time_get() + MS_TO_MCU_TIME(10);
+}
+
+void ssd1306_finish_init(void)
+{
+	time_wait_until(ready_time);
 
 	/* Configuration */
 	ssd1306_send_cmd_2b(REG_MUX_RATIO, 0x3F);
@@ -59,7 +59,11 @@ typedef enum{
 } pwr_mode_t;
 
 
+/* Starts the power-up sequence, which takes some time. Anything can be done in the
+ * meantime, as long as ssd1306_finish_init() is called before using the display.
+ */
 void ssd1306_init(void);
+void ssd1306_finish_init(void);
 
 void ssd1306_set_display_mode(disp_mode_t mode);
 void ssd1306_set_power_mode(pwr_mode_t mode);
@@ -21,31 +21,206 @@
 
 #include "ff_gen_drv.h"
 
+#include "time.h"
+#include "fs_ll.h"
 #include "lib/tamalib.h"
+#include "record.h"
 #include "state.h"
 
-#define STATE_SLOT_SIZE					821 // in bytes
-
 #define STATE_FILE_MAGIC				"TLST"
 #define STATE_FILE_VERSION				2
 
-static uint8_t state_buf[STATE_SLOT_SIZE];
+/* Files are allocated once and then rewritten in place, one sector by each save step */
+#define STATE_SECTORS					((STATE_SIZE + _MAX_SS - 1)/_MAX_SS)
+#define SECTOR_SIZE_U32					(_MAX_SS/sizeof(uint32_t))
+
+/* FNV-1a, only used to tell whether the host changed a file */
+#define FILE_HASH_INIT					2166136261UL
+#define FILE_HASH_PRIME					16777619UL
+#define FILE_HASH_CHUNK_SIZE				32 // bytes read at once
+
+typedef enum {
+	SAVE_IDLE = 0,
+	SAVE_RECORD,
+	SAVE_RECORD_WRITE,
+	SAVE_LOCATE,
+	SAVE_WRITE,
+} save_step_t;
+
+/* Whole sectors, so that they can be written straight to the volume */
+static uint32_t state_words[STATE_SECTORS * SECTOR_SIZE_U32];
+static uint8_t *state_buf = (uint8_t *) state_words;
 
 static char state_file_name[] = "saveX.bin";
 
+/* Pending save, state_buf holds its snapshot */
+static save_step_t save_step = SAVE_IDLE;
+static uint8_t save_slot;
+static uint32_t save_sector;
+static uint8_t save_pos;
 
-void state_save(uint8_t slot)
+/* Time spent saving, only accounting for the steps */
+static mcu_time_t save_busy_time = 0;
+static uint32_t save_time = 0;
+
+/* The file system is not available */
+static uint8_t files_held = 0;
+
+/* Autosave file as left to the host, a missing file has no hash */
+static uint32_t held_hash;
+static int8_t held_hash_ret;
+
+/* One bit per slot with a file, so that menus do not walk the directory on each redraw */
+static uint16_t slots_used = 0;
+static uint8_t slots_known = 0;
+
+
+static uint8_t is_contiguous(FIL *f)
+{
+	DWORD clmt[4];
+	FRESULT res;
+
+	/* Fails if the file is made of more than one fragment */
+	clmt[0] = sizeof(clmt)/sizeof(DWORD);
+	f->cltbl = clmt;
+	res = f_lseek(f, CREATE_LINKMAP);
+	f->cltbl = NULL;
+
+	return (res == FR_OK && clmt[1] != 0);
+}
+
+static int8_t locate_file(uint8_t slot, uint32_t *sector)
+{
+	FIL f;
+
+	state_file_name[4] = slot + '0';
+
+	if (f_open(&f, state_file_name, FA_OPEN_ALWAYS | FA_WRITE)) {
+		/* Error */
+		return -1;
+	}
+
+	slots_used |= (1 << slot);
+
+	/* New files, and files rewritten from the USB host, are allocated again as a single fragment */
+	if (f_size(&f) != STATE_SIZE || !is_contiguous(&f)) {
+		if (f_lseek(&f, 0) || f_truncate(&f) || f_expand(&f, STATE_SIZE, 1)) {
+			/* Error */
+			f_close(&f);
+			return -1;
+		}
+	}
+
+	*sector = f.obj.fs->database + (f.obj.sclust - 2) * f.obj.fs->csize;
+
+	if (f_close(&f)) {
+		/* Error */
+		return -1;
+	}
+
+	return 0;
+}
+
+static int8_t write_file(uint8_t slot)
+{
+	uint32_t sector;
+
+	if (locate_file(slot, &sector) < 0) {
+		return -1;
+	}
+
+	/* Neither the FAT nor the directory entry need to be updated */
+	return fs_ll_write(sector, state_words, STATE_SECTORS);
+}
+
+static int8_t read_file(uint8_t slot)
 {
 	FIL f;
 	UINT num;
-	state_t *state;
-	uint8_t *ptr = state_buf;
-	uint32_t i;
 
-	if (slot >= STATE_SLOTS_NUM) {
+	state_file_name[4] = slot + '0';
+
+	if (f_open(&f, state_file_name, FA_OPEN_EXISTING | FA_READ)) {
+		/* Error */
+		return -1;
+	}
+
+	if (f_read(&f, state_buf, STATE_SIZE, &num) || (num < STATE_SIZE)) {
+		/* Error */
+		f_close(&f);
+		return -1;
+	}
+
+	f_close(&f);
+
+	return 0;
+}
+
+static int8_t hash_file(uint8_t slot, uint32_t *hash)
+{
+	FIL f;
+	UINT num, i;
+	uint8_t buf[FILE_HASH_CHUNK_SIZE];
+
+	state_file_name[4] = slot + '0';
+
+	if (f_open(&f, state_file_name, FA_OPEN_EXISTING | FA_READ)) {
+		/* Error */
+		return -1;
+	}
+
+	*hash = FILE_HASH_INIT;
+
+	do {
+		if (f_read(&f, buf, sizeof(buf), &num)) {
+			/* Error */
+			f_close(&f);
+			return -1;
+		}
+
+		for (i = 0; i < num; i++) {
+			*hash = (*hash ^ buf[i]) * FILE_HASH_PRIME;
+		}
+	} while (num == sizeof(buf));
+
+	f_close(&f);
+
+	return 0;
+}
+
+static void scan_slots(void)
+{
+	uint8_t slot;
+
+	if (files_held) {
+		/* Nothing can be found until the files are released */
 		return;
 	}
 
+	slots_used = 0;
+
+	for (slot = 0; slot < STATE_SLOTS_NUM; slot++) {
+		state_file_name[4] = slot + '0';
+
+		if (f_stat(state_file_name, NULL) == FR_OK) {
+			slots_used |= (1 << slot);
+		}
+	}
+
+	slots_known = 1;
+}
+
+static void finish_save(void)
+{
+	while (state_save_step() > 0);
+}
+
+void state_snapshot(uint8_t *buf)
+{
+	state_t *state;
+	uint8_t *ptr = buf;
+	uint32_t i;
+
 	state = tamalib_get_state();
 
 	/* First the magic, then the version, and finally the fields of
@@ -143,51 +318,140 @@ void state_save(uint8_t slot)
 		ptr[i] = GET_RAM_MEMORY(state->memory, i + MEM_IO_ADDR) & 0xF;
 	}
 	ptr += MEM_IO_SIZE;
+}
 
-	state_file_name[4] = slot + '0';
+void state_save_start(uint8_t slot)
+{
+	mcu_time_t start;
 
-	if (f_open(&f, state_file_name, FA_CREATE_ALWAYS | FA_WRITE)) {
-		/* Error */
+	if (slot >= STATE_SLOTS_NUM) {
 		return;
 	}
 
-        if (f_write(&f, state_buf, sizeof(state_buf), &num) || (num < sizeof(state_buf))) {
-		/* Error */
-		f_close(&f);
-		return;
-	}
+	/* Only one save at a time */
+	finish_save();
 
-	f_close(&f);
+	start = time_get();
+
+	state_snapshot(state_buf);
+
+	save_slot = slot;
+	save_step = (slot == STATE_AUTOSAVE_SLOT) ? SAVE_RECORD : SAVE_LOCATE;
+	save_busy_time = time_get() - start;
 }
 
-void state_load(uint8_t slot)
+int8_t state_save_step(void)
 {
-	FIL f;
-	UINT num;
-	state_t *state;
-	uint8_t *ptr = state_buf;
-	uint32_t i;
+	mcu_time_t start = time_get();
+	int8_t ret = 0;
+
+	switch (save_step) {
+		case SAVE_RECORD:
+			/* The autosave slot is only written to a file if there is no data EEPROM, or by state_mirror().
+			 * While the files are held, the file is the reference and the save waits in RAM like the others.
+			 */
+			save_step = (!files_held && record_write_start(RECORD_AUTOSAVE, state_buf, STATE_SIZE) == 0) ? SAVE_RECORD_WRITE : SAVE_LOCATE;
+			break;
+
+		case SAVE_RECORD_WRITE:
+			/* A few EEPROM words at a time, a whole new base image would take hundreds of ms */
+			switch (record_write_step()) {
+				case 0:
+					save_step = SAVE_IDLE;
+					break;
+
+				case 1:
+					break;
+
+				default:
+					save_step = SAVE_LOCATE;
+					break;
+			}
+			break;
+
+		case SAVE_LOCATE:
+			if (files_held) {
+				/* The snapshot stays in state_buf until the files are released */
+				return 0;
+			}
+
+			if (locate_file(save_slot, &save_sector) < 0) {
+				/* Error */
+				save_step = SAVE_IDLE;
+				ret = -1;
+				break;
+			}
+
+			save_pos = 0;
+			save_step = SAVE_WRITE;
+			break;
+
+		case SAVE_WRITE:
+			if (fs_ll_write(save_sector + save_pos, &state_words[save_pos * SECTOR_SIZE_U32], 1) < 0) {
+				/* Error */
+				save_step = SAVE_IDLE;
+				ret = -1;
+				break;
+			}
+
+			if (++save_pos >= STATE_SECTORS) {
+				save_step = SAVE_IDLE;
+			}
+			break;
+
+		case SAVE_IDLE:
+			return 0;
+	}
 
-	if (slot >= STATE_SLOTS_NUM) {
-		return;
+	save_busy_time += time_get() - start;
+
+	if (save_step == SAVE_IDLE) {
+		save_time = ((uint64_t) save_busy_time * 1000000ULL)/MCU_TIME_FREQ_X1000;
 	}
 
-	state = tamalib_get_state();
+	return (ret < 0) ? ret : (save_step != SAVE_IDLE);
+}
 
-	state_file_name[4] = slot + '0';
+void state_save(uint8_t slot)
+{
+	state_save_start(slot);
+	finish_save();
+}
 
-	if (f_open(&f, state_file_name, FA_OPEN_EXISTING | FA_READ)) {
-		/* Error */
-		return;
+uint32_t state_get_save_time(void)
+{
+	return save_time;
+}
+
+void state_hold_files(uint8_t hold)
+{
+	uint32_t hash;
+
+	if (hold && !files_held) {
+		held_hash_ret = hash_file(STATE_AUTOSAVE_SLOT, &held_hash);
 	}
 
-	if (f_read(&f, state_buf, sizeof(state_buf), &num) || (num < sizeof(state_buf))) {
-		/* Error */
-		f_close(&f);
-		return;
+	if (!hold && files_held) {
+		/* An autosave taken meanwhile must not replace an autosave file edited by the host */
+		if (save_step != SAVE_IDLE && save_slot == STATE_AUTOSAVE_SLOT &&
+			(hash_file(STATE_AUTOSAVE_SLOT, &hash) != held_hash_ret || (held_hash_ret == 0 && hash != held_hash))) {
+			save_step = SAVE_IDLE;
+		}
+
+		/* The USB host might have added or removed any file */
+		slots_known = 0;
 	}
 
-	f_close(&f);
+	files_held = hold;
+}
+
+int8_t state_restore(uint8_t *buf)
+{
+	state_t *state;
+	uint8_t *ptr = buf;
+	uint32_t i;
+
+	state = tamalib_get_state();
 
 	/* First the magic, then the version, and finally the fields of
 	 * the state_t struct written as u8, u16 little-endian or u32
@@ -195,13 +459,13 @@ void state_load(uint8_t slot)
 	 */
 	if (ptr[0] != (uint8_t) STATE_FILE_MAGIC[0] || ptr[1] != (uint8_t) STATE_FILE_MAGIC[1] ||
 		ptr[2] != (uint8_t) STATE_FILE_MAGIC[2] || ptr[3] != (uint8_t) STATE_FILE_MAGIC[3]) {
-		return;
+		return -1;
 	}
 	ptr += 4;
 
 	if (ptr[0] != STATE_FILE_VERSION) {
 		/* TODO: Handle migration at a point */
-		return;
+		return -1;
 	}
 	ptr += 1;
 
@@ -274,6 +538,25 @@ void state_load(uint8_t slot)
 	ptr += MEM_IO_SIZE;
 
 	tamalib_refresh_hw();
+
+	return 0;
+}
+
+void state_load(uint8_t slot)
+{
+	if (slot >= STATE_SLOTS_NUM) {
+		return;
+	}
+
+	/* The pending save uses the same buffer */
+	finish_save();
+
+	/* The EEPROM record is more recent than the file, if any */
+	if ((slot != STATE_AUTOSAVE_SLOT || record_read(RECORD_AUTOSAVE, state_buf, STATE_SIZE) < 0) && read_file(slot) < 0) {
+		return;
+	}
+
+	state_restore(state_buf);
 }
 
 void state_erase(uint8_t slot)
@@ -282,9 +565,16 @@ void state_erase(uint8_t slot)
 		return;
 	}
 
+	finish_save();
+
+	if (slot == STATE_AUTOSAVE_SLOT) {
+		record_invalidate(RECORD_AUTOSAVE);
+	}
+
 	state_file_name[4] = slot + '0';
 
 	f_unlink(state_file_name);
+	slots_used &= ~(1 << slot);
 }
 
 uint8_t state_stat(uint8_t slot)
@@ -293,8 +583,31 @@ uint8_t state_stat(uint8_t slot)
 		return 0;
 	}
 
-	state_file_name[4] = slot + '0';
+	finish_save();
+
+	if (slot == STATE_AUTOSAVE_SLOT && record_stat(RECORD_AUTOSAVE)) {
+		return 1;
+	}
+
+	if (!slots_known) {
+		scan_slots();
+	}
 
 	/* Check if the slot is used */
-	return (f_stat(state_file_name, NULL) == FR_OK);
+	return ((slots_used >> slot) & 0x1);
+}
+
+void state_mirror(void)
+{
+	finish_save();
+
+	if (record_read(RECORD_AUTOSAVE, state_buf, STATE_SIZE) < 0) {
+		/* Nothing to do */
+		return;
+	}
+
+	/* Once written, the file becomes the reference, so that it can be replaced over USB */
+	if (write_file(STATE_AUTOSAVE_SLOT) == 0) {
+		record_invalidate(RECORD_AUTOSAVE);
+	}
 }
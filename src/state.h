@@ -23,11 +23,37 @@
 #include <stdint.h>
 
 #define STATE_SLOTS_NUM					10
+#define STATE_AUTOSAVE_SLOT				0 // Kept in the data EEPROM when there is one
+
+#define STATE_SIZE					821 // in bytes, as stored in a slot
 
 
 void state_save(uint8_t slot);
+
+/* Same as state_save(), but only the snapshot is taken at once. The write is then
+ * performed by calling state_save_step() until it does not return 1 anymore.
+ */
+void state_save_start(uint8_t slot);
+int8_t state_save_step(void);
 void state_load(uint8_t slot);
 void state_erase(uint8_t slot);
 uint8_t state_stat(uint8_t slot);
 
+/* Time spent performing the last completed save in ms, the steps only */
+uint32_t state_get_save_time(void);
+
+/* While held, the saves are kept in RAM instead of being written to the file system,
+ * the autosave included, the pending one is written by state_save_step() once released.
+ * A newer save replaces it. A pending autosave is dropped if the autosave file has been
+ * changed meanwhile, so that the file from the host is used.
+ */
+void state_hold_files(uint8_t hold);
+
+/* Serializes the current state to STATE_SIZE bytes, or restores it from them */
+void state_snapshot(uint8_t *buf);
+int8_t state_restore(uint8_t *buf);
+
+/* Copies the autosave slot kept in the data EEPROM to the file system */
+void state_mirror(void);
+
 #endif /* _STATE_H_ */
@@ -25,6 +25,10 @@
 #include "board.h"
 #include "uc1701x.h"
 
+/* End of the power-up delay */
+static mcu_time_t ready_time;
+
+
 void uc1701x_init(void)
 {
 	spi_init();
@@ -46,7 +50,13 @@ void uc1701x_init(void)
 	uc1701x_send_cmd_1b(REG_SEG_DIR, 1);
 	uc1701x_send_cmd_1b(REG_COM_DIR, 0);
 
-	time_delay(MS_TO_MCU_TIME(120));
+	ready_time = time_get() + MS_TO_MCU_TIME(120);
+}
+
+void uc1701x_finish_init(void)
+{
+	time_wait_until(ready_time);
+
 	uc1701x_send_cmd_1b(REG_LCD_BIAS_RATIO, 0);
 	uc1701x_send_cmd_2b(REG_ELEC_VOLUME, 50);
 	uc1701x_send_cmd_1b(REG_VLCD_RES_RATIO, 3);
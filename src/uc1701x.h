@@ -54,7 +54,11 @@ typedef enum{
 } pwr_mode_t;
 
 
+/* Starts the power-up sequence, which takes some time. Anything can be done in the
+ * meantime, as long as uc1701x_finish_init() is called before using the display.
+ */
 void uc1701x_init(void);
+void uc1701x_finish_init(void);
 
 void uc1701x_set_display_mode(disp_mode_t mode);
 void uc1701x_set_power_mode(pwr_mode_t mode);
@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+#
+# MCUGotchi - A Tamagotchi P1 emulator for microcontrollers
+#
+# Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+#
+# Talk to MCUGotchi over the link protocol (see src/link.h), either through the
+# vendor interface exposed in USB mode, or through any pipe carrying the same
+# bytes (e.g. a host build of the command parser).
+
+import argparse
+import struct
+import subprocess
+import sys
+
+VID = 0x0483
+PID = 0x5740
+EP_OUT = 0x02
+EP_IN = 0x82
+
+CMD_PING = 0
+CMD_GET_STATE = 1
+CMD_SET_STATE = 2
+CMD_ROM_BEGIN = 3
+CMD_ROM_DATA = 4
+CMD_ROM_END = 5
+CMD_GET_FRAME = 6
+
+ROM_CHUNK_SIZE = 512
+LCD_WIDTH = 32
+LCD_HEIGHT = 16
+
+
+class UsbTransport:
+    def __init__(self):
+        import usb.core
+        self.dev = usb.core.find(idVendor=VID, idProduct=PID)
+        if self.dev is None:
+            sys.exit("Device not found, is USB mode enabled ?")
+
+    def write(self, data):
+        self.dev.write(EP_OUT, data)
+
+    def read(self, length):
+        data = bytes()
+        while len(data) < length:
+            data += bytes(self.dev.read(EP_IN, length - len(data)))
+        return data
+
+
+class PipeTransport:
+    def __init__(self, cmd):
+        self.proc = subprocess.Popen(cmd, shell=True, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+
+    def write(self, data):
+        self.proc.stdin.write(data)
+        self.proc.stdin.flush()
+
+    def read(self, length):
+        return self.proc.stdout.read(length)
+
+
+def request(transport, cmd, payload=b"", arg=0):
+    transport.write(struct.pack("<BBH", cmd, arg, len(payload)) + payload)
+    status, length = struct.unpack("<BH", transport.read(3))
+    data = transport.read(length) if length else b""
+    if status != 0:
+        sys.exit("Command %d failed with status %d" % (cmd, status))
+    return data
+
+
+def main():
+    parser = argparse.ArgumentParser(description="MCUGotchi link client")
+    parser.add_argument("--pipe", help="command to talk to instead of the USB device")
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    sub.add_parser("ping")
+    sub.add_parser("get-state").add_argument("file")
+    sub.add_parser("set-state").add_argument("file")
+    sub.add_parser("rom", help="program a big-endian ROM dump and run it").add_argument("file")
+    sub.add_parser("frame")
+    args = parser.parse_args()
+
+    transport = PipeTransport(args.pipe) if args.pipe else UsbTransport()
+
+    if args.cmd == "ping":
+        print("Protocol version %d" % request(transport, CMD_PING)[0])
+    elif args.cmd == "get-state":
+        with open(args.file, "wb") as f:
+            f.write(request(transport, CMD_GET_STATE))
+    elif args.cmd == "set-state":
+        with open(args.file, "rb") as f:
+            request(transport, CMD_SET_STATE, f.read())
+    elif args.cmd == "rom":
+        with open(args.file, "rb") as f:
+            data = f.read()
+        data += b"\0" * (-len(data) % 4)
+        request(transport, CMD_ROM_BEGIN)
+        for i in range(0, len(data), ROM_CHUNK_SIZE):
+            request(transport, CMD_ROM_DATA, data[i:i + ROM_CHUNK_SIZE])
+        request(transport, CMD_ROM_END)
+    elif args.cmd == "frame":
+        frame = request(transport, CMD_GET_FRAME)
+        for y in range(LCD_HEIGHT):
+            print("".join("#" if frame[(y * LCD_WIDTH + x) // 8] & (0x80 >> (x % 8)) else "." for x in range(LCD_WIDTH)))
+        print("Icons: %s" % " ".join(str(i) for i in range(8) if frame[-1] & (1 << i)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+#
+# MCUGotchi - A Tamagotchi P1 emulator for microcontrollers
+#
+# Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+#
+# Symbolize a profile.bin histogram dumped by MCUGotchi (see src/profiler.c)
+# against a Tamagotchi P1 ROM and, optionally, a disassembly listing whose
+# lines start with the hexadecimal address of the instruction.
+
+import argparse
+import re
+import struct
+import sys
+
+PROFILE_MAGIC = b"TLPF"
+PROFILE_VERSION = 1
+CLASS_NUM = 16
+
+CLASS_NAMES = [
+    "JP s", "RETD e", "JP C,s", "JP NC,s", "CALL s", "CALZ s", "JP Z,s", "JP NZ,s",
+    "LD Y,e", "LBPX MX,e", "ALU r,q", "LD X,e", "ALU r,i", "ALU r,i", "LD/misc", "misc",
+]
+
+
+def load_profile(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    if data[0:4] != PROFILE_MAGIC:
+        sys.exit("%s: bad magic" % path)
+
+    version, pc_shift, scale, bucket_num, total = struct.unpack_from("<BBBHI", data, 4)
+    if version != PROFILE_VERSION:
+        sys.exit("%s: unsupported version %d" % (path, version))
+
+    offset = 13
+    classes = struct.unpack_from("<%dI" % CLASS_NUM, data, offset)
+    offset += 4 * CLASS_NUM
+    buckets = struct.unpack_from("<%dH" % bucket_num, data, offset)
+
+    return pc_shift, scale, total, classes, buckets
+
+
+def load_rom(path):
+    with open(path, "rb") as f:
+        data = f.read()
+
+    # Native files (see tools/rom2native.py) hold little-endian u12_t, and are
+    # told apart from big-endian dumps the same way as in rom_load(): the upper
+    # nibble of every instruction is clear
+    native = [data[i] | (data[i + 1] << 8) for i in range(0, len(data) - 1, 2)]
+    if not any(op & 0xF000 for op in native):
+        return native
+
+    # Same conversion as rom_load() for big-endian dumps
+    return [((data[i] & 0xF) << 8) | data[i + 1] for i in range(0, len(data) - 1, 2)]
+
+
+def load_listing(path):
+    listing = {}
+    addr_re = re.compile(r"^\s*(?:0x)?([0-9A-Fa-f]{3,4})\b")
+
+    with open(path) as f:
+        for line in f:
+            m = addr_re.match(line)
+            if m:
+                listing[int(m.group(1), 16)] = line.rstrip()
+
+    return listing
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Symbolize an MCUGotchi ROM profile")
+    parser.add_argument("profile", help="profile.bin dumped by the device")
+    parser.add_argument("-r", "--rom", help="ROM file (romX.bin)")
+    parser.add_argument("-l", "--listing", help="disassembly listing of the ROM")
+    parser.add_argument("-n", "--top", type=int, default=20, help="number of hot spots to show")
+    args = parser.parse_args()
+
+    pc_shift, scale, total, classes, buckets = load_profile(args.profile)
+    rom = load_rom(args.rom) if args.rom else None
+    listing = load_listing(args.listing) if args.listing else {}
+
+    print("Total steps: %d" % total)
+    print()
+    print("Opcode classes:")
+    for i in sorted(range(CLASS_NUM), key=lambda c: classes[c], reverse=True):
+        if classes[i]:
+            print("  0x%X00-0x%XFF %-10s %10d %6.2f%%" % (i, i, CLASS_NAMES[i], classes[i], 100.0 * classes[i] / max(total, 1)))
+
+    # Buckets have been halved "scale" times on the device
+    hits = sum(buckets)
+    print()
+    print("Hot spots (%d instructions per bucket, counts scaled by 2^%d):" % (1 << pc_shift, scale))
+    for b in sorted(range(len(buckets)), key=lambda b: buckets[b], reverse=True)[:args.top]:
+        if not buckets[b]:
+            break
+
+        start = b << pc_shift
+        print("  0x%04X-0x%04X %10d %6.2f%%" % (start, start + (1 << pc_shift) - 1, buckets[b] << scale, 100.0 * buckets[b] / max(hits, 1)))
+
+        for pc in range(start, start + (1 << pc_shift)):
+            if pc in listing:
+                print("      %s" % listing[pc])
+            elif rom is not None and pc < len(rom):
+                print("      0x%04X: 0x%03X  %s" % (pc, rom[pc], CLASS_NAMES[rom[pc] >> 8]))
+
+
+if __name__ == "__main__":
+    main()
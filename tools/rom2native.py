@@ -0,0 +1,51 @@
+#!/usr/bin/env python3
+#
+# MCUGotchi - A Tamagotchi P1 emulator for microcontrollers
+#
+# Copyright (C) 2021 Jean-Christophe Rona <jc@rona.fr>
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+#
+# Convert a Tamagotchi P1 ROM dump (big-endian, 2 bytes per instruction) to
+# the native format (u12_t little-endian) that MCUGotchi executes in place
+# from its file system, as long as the file is not fragmented.
+
+import argparse
+import sys
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert a ROM dump to the native MCUGotchi format")
+    parser.add_argument("input", help="big-endian ROM dump")
+    parser.add_argument("output", help="native ROM (e.g. rom0.bin)")
+    args = parser.parse_args()
+
+    with open(args.input, "rb") as f:
+        data = f.read()
+
+    if len(data) % 2:
+        sys.exit("Invalid ROM size")
+
+    out = bytearray()
+    for i in range(0, len(data), 2):
+        op = ((data[i] & 0xF) << 8) | data[i + 1]
+        out += bytes((op & 0xFF, op >> 8))
+
+    with open(args.output, "wb") as f:
+        f.write(out)
+
+
+if __name__ == "__main__":
+    main()